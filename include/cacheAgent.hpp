@@ -11,17 +11,61 @@ namespace RACoherence {
 extern std::atomic<bool> complete;
 constexpr size_t LOG_MAX_BATCH = 100;
 
+// A node runs CACHE_AGENT_COUNT agents. Agent k owns the logs of source
+// nodes i with i % CACHE_AGENT_COUNT == k, and consumes from the others only
+// once its own logs are drained. Each source's log is consumed under its own
+// head mutex, so clocks of a source are still updated in order. Agents only
+// visit logs whose bits they claimed from the node's doorbell.
 class CacheAgent {
     unsigned count = 0;
     unsigned node_id;
+    unsigned agent_id;
 
     // CXL mem shared adta
     LogManager *log_mgrs;
+    Doorbell &doorbell;
     // node local data
     CacheInfo &cache_info;
 
+    // nodes whose logs may have entries left, claimed from the doorbell
+    uint64_t pending = 0;
+    // nodes owned by this agent
+    uint64_t own_mask = 0;
+    // node visited first among those nobody is blocked on
+    unsigned next_start = 0;
+
+    inline bool owns(unsigned i) const {
+        return i % CACHE_AGENT_COUNT == agent_id;
+    }
+
+    // consume a batch of logs from node i, returns whether any was consumed
+    // and sets more unless the log was found empty
+    bool consume(unsigned i, bool &more);
+
+    // consume from each node in bits and update pending
+    bool consume_nodes(uint64_t bits);
+
+    // consume from the nodes in mask that have pending logs, nodes that
+    // threads are blocked on first
+    bool consume_pending(uint64_t mask);
+
+    // whether any log may have entries left to consume
+    inline bool has_logs() const {
+        return pending || doorbell.pending.load();
+    }
+
+    // back off after idle_rounds rounds without work: spin with pause first,
+    // then wait for producers with umwait if supported, then in the kernel
+    void idle_wait(unsigned idle_rounds);
+
 public:
-    CacheAgent(CacheInfo &cinfo, LogManager *lmgrs, unsigned nid): cache_info(cinfo), log_mgrs(lmgrs), node_id(nid) {}
+    CacheAgent(CacheInfo &cinfo, LogManager *lmgrs, Doorbell &d, unsigned nid, unsigned aid = 0): node_id(nid), agent_id(aid), log_mgrs(lmgrs), doorbell(d), cache_info(cinfo) {
+        for (unsigned i = 0; i < NODE_COUNT; i++)
+            if (owns(i) && i != node_id)
+                own_mask |= 1ull << i;
+        // logs may have been published before the agent started
+        pending = own_mask;
+    }
 
     void run();
 };
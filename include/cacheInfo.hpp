@@ -1,11 +1,14 @@
 #ifndef _CACHE_INFO_H_
 #define _CACHE_INFO_H_
 
+#include <shared_mutex>
 #include <x86intrin.h>
 
+#include "calibration.hpp"
 #include "clGroup.hpp"
 #include "clTracker.hpp"
 #include "flushUtils.hpp"
+#include "invalidateJobs.hpp"
 #include "logManager.hpp"
 #include "utils.hpp"
 #include "vectorClock.hpp"
@@ -14,15 +17,84 @@ namespace RACoherence {
 
 using AtomicClock = std::atomic<vc_clock_t>[NODE_COUNT];
 
+#if LAZY_INVALIDATE
+// granularity at which reads of lazily invalidated lines are tracked
+constexpr uint64_t HEAT_REGION_SHIFT = 16;
+constexpr uintptr_t HEAT_REGION_MASK = (1ull << HEAT_REGION_SHIFT) - 1;
+// number of recently read regions drained first by the cache agent
+constexpr size_t RECENT_REGION_SLOTS = 64;
+// address range covered by the tracker
+constexpr uintptr_t TRACKED_START = CXL_NHC_START;
+constexpr uintptr_t TRACKED_END = CXL_NHC_START + (1ull << TRACKER_VA_BITS);
+#endif
+
+#if HYBRID_INVALIDATE
+constexpr size_t HEAT_TABLE_SIZE = 4096;
+constexpr uint8_t HEAT_MAX = 4 * HYBRID_HOT_THRESHOLD;
+
+// Sampled counts of lazy invalidations by user threads per region, hashed by
+// address. A region that is read often after being released is cheaper to
+// invalidate eagerly than to look up in the tracker on every access. Heat
+// cools each time the region is invalidated eagerly, so regions no longer read
+// drift back to lazy invalidation. Updates are racy, counts are a heuristic.
+class RegionHeat {
+    std::atomic<uint8_t> counts[HEAT_TABLE_SIZE]{};
+
+    static inline size_t slot(uintptr_t va) {
+        return (va >> HEAT_REGION_SHIFT) & (HEAT_TABLE_SIZE - 1);
+    }
+
+public:
+    inline void record(uintptr_t va) {
+        auto &count = counts[slot(va)];
+        uint8_t c = count.load(std::memory_order_relaxed);
+        if (c < HEAT_MAX)
+            count.store(c + 1, std::memory_order_relaxed);
+    }
+
+    // returns whether the region of va is hot, and cools it if so
+    inline bool cool_if_hot(uintptr_t va) {
+        auto &count = counts[slot(va)];
+        uint8_t c = count.load(std::memory_order_relaxed);
+        if (c < HYBRID_HOT_THRESHOLD)
+            return false;
+        count.store(c - 1, std::memory_order_relaxed);
+        return true;
+    }
+};
+#endif
+
 struct CacheInfo {
     using Mutex = LogManager::Mutex;
 
     AtomicClock clock;
     CacheAligned<Mutex> log_head_mtxs[NODE_COUNT];
+    // highest clock of each node that threads on this node are blocked on,
+    // met once it is not above the node's clock
+    AtomicClock demand;
 
     // data-race on cach line tracker entries should be ruled out
     // by cache line race freedom.
     CacheLineTracker inv_cls;
+#if LAZY_INVALIDATE
+    // held shared while logs are processed, and exclusively by tracker
+    // operations that must not run concurrently with marking
+    std::shared_mutex mark_mtx;
+#endif
+#if HYBRID_INVALIDATE
+    RegionHeat heat;
+#endif
+#if (EAGER_INVALIDATE || HYBRID_INVALIDATE) && PARALLEL_INVALIDATE
+    // shards of a long range being invalidated
+    InvalidateJobs inv_jobs;
+#endif
+#if LAZY_INVALIDATE && BACKGROUND_INVALIDATE
+    // regions recently read by user threads, 0 if empty
+    std::atomic<uintptr_t> recent_regions[RECENT_REGION_SLOTS]{};
+    std::atomic<unsigned> recent_region_pos{0};
+    // where the cache agent resumes draining the tracker
+    uintptr_t drain_cursor = TRACKED_START;
+#endif
 
     // per-node stats
 #ifdef STATS
@@ -30,7 +102,7 @@ struct CacheInfo {
     std::atomic<unsigned> produced_count;
 #endif
 
-    CacheInfo(): clock(), inv_cls(), consumed_count{}, produced_count{0} {};
+    CacheInfo(): clock(), demand(), inv_cls(), consumed_count{}, produced_count{0} {};
 
     Mutex &get_log_head_mutex(unsigned nid) {
         return log_head_mtxs[nid];
@@ -64,6 +136,23 @@ struct CacheInfo {
     //}
 
     void process_log(Log &log) {
+#if LAZY_INVALIDATE
+        bool bulk;
+        {
+            std::shared_lock<std::shared_mutex> lk(mark_mtx);
+            bulk = process_entries(log);
+        }
+#else
+        bool bulk = process_entries(log);
+#endif
+#ifdef WBINVD_PATH
+        if (bulk)
+            bulk_invalidate();
+#endif
+    }
+
+    // returns whether the whole cache should be invalidated instead
+    bool process_entries(Log &log) {
         using namespace cl_group;
         for (auto entry: log) {
 #if !LOCAL_CL_TABLE
@@ -72,31 +161,130 @@ struct CacheInfo {
             if (is_length_based(entry)) {
                 unsigned length = get_length(entry);
 #ifdef WBINVD_PATH
-                if (length >= WBINVD_THRESHOLD) {
-                    wbinvd();
-                    return;
-                }
+                if (length >= flush_policy.wbinvd_groups)
+                    return true;
 #endif
                 uintptr_t cl_addr = get_ptr(entry);
-#if EAGER_INVALIDATE
-                for (unsigned i = 0; i < length * GROUP_SIZE * CL_EXPAND_FACTOR; i++)
-                    do_invalidate((char *)cl_addr + i * CACHE_LINE_SIZE);
+                uintptr_t cl_end = cl_addr + ((uintptr_t)length << GROUP_SHIFT);
+#if HYBRID_INVALIDATE
+                if (length < HYBRID_LAZY_THRESHOLD)
+                    invalidate_range(cl_addr, cl_end);
+                else
+                    defer_range(cl_addr, cl_end);
+#elif EAGER_INVALIDATE
+                invalidate_range(cl_addr, cl_end);
 #else
-                for (unsigned i = 0; i < length; i++)
-                    inv_cls.mark_dirty(cl_addr + i, FULL_MASK << get_mask16_to_64_shift(cl_addr));
+                inv_cls.mark_range_dirty(cl_addr, cl_end);
 #endif
             } else {
-#if EAGER_INVALIDATE
-                for (auto cl_addr: MaskCLRange(get_ptr(entry), get_mask16(entry)))
-                    // should be unrolled, manually unroll if not
-                    for (unsigned i = 0; i < CL_EXPAND_FACTOR; i++)
-                        do_invalidate((char *)cl_addr + i * CACHE_LINE_SIZE);
+#if EAGER_INVALIDATE || HYBRID_INVALIDATE
+                invalidate_mask((char *)get_ptr(entry), get_mask16(entry));
 #else
                 inv_cls.mark_dirty(get_ptr(entry),  get_mask16(entry) << get_mask16_to_64_shift(entry));
 #endif
             }
 #endif
         }
+#if LAZY_INVALIDATE && LOCAL_CL_TABLE && defined(WBINVD_PATH)
+        // the tracker grew too large to be checked and drained cheaply
+        if (inv_cls.leaf_count() >= flush_policy.tracker_wbinvd_leaves)
+            return true;
+#endif
+        return false;
+    }
+
+#ifdef WBINVD_PATH
+    // writes back and invalidates the whole cache, which also makes
+    // every line pending lazy invalidation clean
+    inline void bulk_invalidate() {
+#if LAZY_INVALIDATE
+        // a line marked while wbinvd runs may have been cached again after
+        // wbinvd reached it, so marking pauses until the tracker is cleared
+        std::unique_lock<std::shared_mutex> lk(mark_mtx);
+#endif
+        wbinvd();
+#if LAZY_INVALIDATE
+        inv_cls.clear_all();
+#endif
+    }
+#endif
+
+    inline void invalidate_range(uintptr_t begin, uintptr_t end) {
+#if (EAGER_INVALIDATE || HYBRID_INVALIDATE) && PARALLEL_INVALIDATE
+        if (InvalidateJobs::is_large(begin, end)) {
+            inv_jobs.invalidate(begin, end);
+            return;
+        }
+#endif
+        invalidate_lines((char *)begin, (char *)end);
+    }
+
+#if HYBRID_INVALIDATE
+    // invalidate hot regions of [begin, end) eagerly and track the rest lazily
+    void defer_range(uintptr_t begin, uintptr_t end) {
+        while (begin < end) {
+            uintptr_t region_end = std::min((begin | HEAT_REGION_MASK) + 1, end);
+            if (heat.cool_if_hot(begin))
+                invalidate_range(begin, region_end);
+            else
+                inv_cls.mark_range_dirty(begin, region_end);
+            begin = region_end;
+        }
+    }
+#endif
+
+#if LAZY_INVALIDATE
+    // called by user threads on lazy invalidation
+    inline void sample_lazy_hit(uintptr_t va) {
+        static __thread unsigned hits = 0;
+        if (++hits % LAZY_SAMPLE_PERIOD)
+            return;
+#if HYBRID_INVALIDATE
+        heat.record(va);
+#endif
+#if BACKGROUND_INVALIDATE
+        unsigned pos = recent_region_pos.fetch_add(1, std::memory_order_relaxed);
+        recent_regions[pos % RECENT_REGION_SLOTS].store(va & ~HEAT_REGION_MASK, std::memory_order_relaxed);
+#endif
+    }
+#endif
+
+#if LAZY_INVALIDATE && BACKGROUND_INVALIDATE
+    // Invalidate up to budget tracked lines ahead of user threads, first in
+    // regions recently read on this node and then round-robin over the
+    // tracker. Gives up if logs are being processed. Called by one thread.
+    // Returns whether there may be more to drain.
+    bool drain_tracker(size_t budget) {
+        if (!inv_cls.leaf_count())
+            return false;
+        std::unique_lock<std::shared_mutex> lk(mark_mtx, std::try_to_lock);
+        if (!lk.owns_lock())
+            return true;
+        const size_t full_budget = budget;
+        for (auto &slot: recent_regions) {
+            if (!budget)
+                return true;
+            uintptr_t region = slot.load(std::memory_order_relaxed);
+            if (!region)
+                continue;
+            slot.store(0, std::memory_order_relaxed);
+            inv_cls.drain_range(region, region + HEAT_REGION_MASK + 1, budget);
+        }
+        drain_cursor = inv_cls.drain_range(drain_cursor, TRACKED_END, budget);
+        if (drain_cursor >= TRACKED_END)
+            drain_cursor = TRACKED_START;
+        return budget != full_budget;
+    }
+#endif
+
+    // take shards of a long range being invalidated by another thread,
+    // returns whether there were any
+    inline bool help_invalidate() {
+#if (EAGER_INVALIDATE || HYBRID_INVALIDATE) && PARALLEL_INVALIDATE
+        return inv_jobs.help();
+#else
+        return false;
+#endif
     }
 
     inline void update_clock(VectorClock::sized_t i, vc_clock_t val) {
@@ -118,6 +306,31 @@ struct CacheInfo {
         return clock[i].load(std::memory_order_relaxed);
     }
 
+    // ask cache agents to consume logs up to target first, nid is the local node
+    inline void post_demand(const VectorClock &target, unsigned nid) {
+        for (VectorClock::sized_t i = 0; i < NODE_COUNT; i++) {
+            vc_clock_t t = target[i];
+            if (i == nid || t <= get_clock(i))
+                continue;
+            auto old = demand[i].load(std::memory_order_relaxed);
+            while (old < t && !demand[i].compare_exchange_weak(old, t));
+        }
+    }
+
+    // clock of node i that threads are blocked on, 0 if none
+    inline vc_clock_t get_demand(VectorClock::sized_t i) {
+        vc_clock_t d = demand[i].load(std::memory_order_relaxed);
+        return d > get_clock(i) ? d : 0;
+    }
+
+    inline uint64_t demanded_nodes() {
+        uint64_t mask = 0;
+        for (VectorClock::sized_t i = 0; i < NODE_COUNT; i++)
+            if (get_demand(i))
+                mask |= 1ull << i;
+        return mask;
+    }
+
     void dump_stats() {
         for (int i = 0; i < NODE_COUNT; i++)
 	        LOG_STATS("consumed count from node " << i << ": " << consumed_count[i].load());
@@ -0,0 +1,49 @@
+#ifndef _CALIBRATION_H_
+#define _CALIBRATION_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "config.hpp"
+
+namespace RACoherence {
+
+// costs measured on this machine, in tsc cycles per line or per operation, 0 if not measured
+struct FlushCosts {
+    double tsc_per_ns = 0;
+    double clflush = 0;
+    double clflushopt = 0;
+    double clwb = 0;
+    double mfence = 0;
+    double sfence = 0;
+    // 0 if wbinvd is not available
+    double wbinvd = 0;
+};
+
+// Sizes from which flushing the whole cache with wbinvd is cheaper than
+// flushing line by line. Start out as the configured thresholds, the cost
+// model replaces them with ones derived from the measured costs.
+struct FlushPolicy {
+    // cache line groups of a length-based entry to invalidate
+    size_t wbinvd_groups = WBINVD_THRESHOLD;
+    // leaves of the lazy invalidation tracker
+    size_t tracker_wbinvd_leaves = TRACKER_WBINVD_THRESHOLD;
+    // bytes of a range written back on release
+    size_t wbinvd_writeback_bytes = SIZE_MAX;
+};
+
+extern FlushCosts flush_costs;
+extern FlushPolicy flush_policy;
+
+// measure flush, fence and wbinvd costs and derive flush_policy from them
+void calibrate_flush_costs();
+
+// derive flush_policy from costs
+void apply_cost_model(const FlushCosts &costs);
+
+// never choose wbinvd, for when WBINVD_PATH is not available
+void disable_bulk_flush();
+
+} // RACoherence
+
+#endif
@@ -47,9 +47,10 @@ namespace cl_group {
         return cg >> GROUP_INDEX_SHIFT;
     }
 
+    // position of the group's 16 line mask in a 64 line mask
     inline uint64_t get_mask16_to_64_shift(cl_group_t cg) {
-        uint8_t diff = cg & 2; //2 = 1 << (log(64/16)-1)
-        return GROUP_SIZE_SHIFT * diff;
+        uint8_t diff = cg & 3; //3 = 64/16 - 1
+        return diff << GROUP_SIZE_SHIFT;
     }
 
     inline cl_group_t try_coalesce(cl_group_idx index1, cl_group_idx index2, size_t len1, size_t len2) {
@@ -1,6 +1,7 @@
 #ifndef _CACHE_TRACKER_H_
 #define _CACHE_TRACKER_H_
 
+#include <algorithm>
 #include <atomic>
 #include <bitset>
 #include <memory>
@@ -11,6 +12,8 @@
 
 #include "config.hpp"
 #include "flushUtils.hpp"
+#include "slabPool.hpp"
+#include "utils.hpp"
 
 //TODO: track cl unit instead of cache line
 namespace RACoherence {
@@ -21,6 +24,14 @@ constexpr uint64_t L2_BITS = 8;
 constexpr uint64_t LEAF_ENTRIES = 1ull << LEAF_BITS;
 constexpr uint64_t L1_ENTRIES = 1ull << L1_BITS;
 constexpr uint64_t L2_ENTRIES = 1ull << L2_BITS;
+constexpr uint64_t LEAF_SHIFT = VIRTUAL_CL_SHIFT + LEAF_BITS; // log(address span of a leaf)
+constexpr uint64_t SUMMARY_WORD_BITS = 64;
+// number of L1 entries checked for stale tables per reclaim() call
+constexpr uint64_t TRACKER_SWEEP_BATCH = 4096;
+// number of leaves drained per invalidate fence
+constexpr unsigned TRACKER_DRAIN_BATCH = 16;
+// bits of a virtual address indexing the tracker, higher bits are ignored
+constexpr uint64_t TRACKER_VA_BITS = LEAF_SHIFT + L2_BITS + L1_BITS;
 
 //class CacheLineTableLeaf {
 //public:
@@ -49,16 +60,19 @@ constexpr uint64_t L2_ENTRIES = 1ull << L2_BITS;
 
 class CacheLineTableLeaf {
 public:
-    //non-atomic is safe assuming no races on cache line, so uint8_t dirty[LEAF_ENTRIES] is another option
+    // seq_cst RMWs order marks against leaf recycling, they compile to the
+    // same locked instructions as relaxed ones on x86
     std::atomic<uint64_t> dirty_mask{0};
+    // link in the tracker's retired list, untouched by readers
+    CacheLineTableLeaf *next_retired = nullptr;
 
     inline uint64_t mark_dirty_with_mask(uint64_t mask) {
-        return dirty_mask.fetch_or(mask, std::memory_order_relaxed);
+        return dirty_mask.fetch_or(mask);
     }
 
     inline void mark_dirty(uint64_t line) {
         uint64_t mask = 1ull << line;
-        dirty_mask.fetch_or(mask, std::memory_order_relaxed);
+        dirty_mask.fetch_or(mask);
     }
 
     inline bool is_dirty(uint64_t line) const {
@@ -67,54 +81,206 @@ public:
     }
 
     inline uint64_t clear_dirty_with_mask(uint64_t mask) {
-        return dirty_mask.fetch_and(~mask, std::memory_order_relaxed);
+        return dirty_mask.fetch_and(~mask);
     }
 
-    inline void clear_dirty(uint64_t line) {
+    inline uint64_t clear_dirty(uint64_t line) {
         uint64_t mask = ~(1ull << line);
-        dirty_mask.fetch_and(mask, std::memory_order_relaxed);
+        return dirty_mask.fetch_and(mask);
+    }
+
+    inline bool is_empty() const {
+        return dirty_mask.load() == 0;
+    }
+};
+
+// one bit per child, set when the child may hold dirty lines.
+// bits are set by mark_dirty and cleared lazily once a child is found empty,
+// so a clear bit means the whole subtree is clean and can be skipped.
+template<size_t N>
+struct SummaryBitmap {
+    std::atomic<uint64_t> words[N / SUMMARY_WORD_BITS]{};
+
+    inline bool test(uint64_t idx) const {
+        return words[idx / SUMMARY_WORD_BITS].load() & (1ull << (idx % SUMMARY_WORD_BITS));
+    }
+
+    // bits of the word containing idx, starting from idx
+    inline uint64_t from(uint64_t idx) const {
+        return words[idx / SUMMARY_WORD_BITS].load() >> (idx % SUMMARY_WORD_BITS);
+    }
+
+    inline void set(uint64_t idx) {
+        uint64_t bit = 1ull << (idx % SUMMARY_WORD_BITS);
+        auto &word = words[idx / SUMMARY_WORD_BITS];
+        // avoid dirtying the summary line when the bit is already set
+        if (!(word.load() & bit))
+            word.fetch_or(bit);
+    }
+
+    inline void clear(uint64_t idx) {
+        words[idx / SUMMARY_WORD_BITS].fetch_and(~(1ull << (idx % SUMMARY_WORD_BITS)));
+    }
+
+    inline bool any() const {
+        for (auto &word: words)
+            if (word.load())
+                return true;
+        return false;
+    }
+
+    // number of children to skip from idx to reach the next possibly set bit
+    static inline uint64_t skip(uint64_t bits, uint64_t idx) {
+        return bits ? __builtin_ctzll(bits) : SUMMARY_WORD_BITS - (idx % SUMMARY_WORD_BITS);
     }
 };
 
 //TODO: try pre-initialize all tables
 class CacheLineTableL2 {
 public:
+    // tracker generation the table was created in, a table from an older
+    // generation holds no dirty lines
+    const uint32_t gen;
+    // link in the tracker's retired list, untouched by readers
+    CacheLineTableL2 *next_retired = nullptr;
+    SummaryBitmap<L2_ENTRIES> summary;
     std::atomic<CacheLineTableLeaf*> leaves[L2_ENTRIES]{};
+
+    CacheLineTableL2(uint32_t gen): gen(gen) {}
+};
+
+// per-thread epoch announced while the thread dereferences tracker nodes
+struct alignas(CACHE_LINE_SIZE) TrackerReader {
+    // global epoch when the current operation started, 0 outside operations
+    std::atomic<uint64_t> epoch{0};
+    // cleared when the owning thread exits, so the record can be reused
+    std::atomic<bool> in_use{true};
+    TrackerReader *next = nullptr;
 };
 
+// Leaves whose masks become empty are unlinked and recycled, so tracker memory
+// follows the current invalidation set. A thread may still hold a pointer to an
+// unlinked leaf, so every operation that dereferences tracker nodes announces
+// the global epoch in its own per-thread record. reclaim() advances the epoch
+// after unlinking, and only reuses retired nodes once no thread announces an
+// older epoch. Readers only write their own line, and operations that find the
+// summaries clear return without announcing at all.
+//
+// L2 tables are tagged with the generation they were created in. clear_all()
+// drops every tracked line at once by starting a new generation, e.g. after a
+// wbinvd, and tables from older generations are treated as empty. They are
+// replaced by the next mark_dirty on them or swept out by reclaim().
 class CacheLineTracker {
     std::atomic<CacheLineTableL2*> l1[L1_ENTRIES]{};
+    SummaryBitmap<L1_ENTRIES> l1_summary;
+    std::atomic<uint32_t> generation{0};
+    // leaves linked in the current generation, approximate
+    std::atomic<int64_t> live_leaves{0};
+    // next L1 entry to check for stale tables, L1_ENTRIES when done
+    std::atomic<uint64_t> sweep_pos{L1_ENTRIES};
+
+    std::atomic<CacheLineTableLeaf*> retired{nullptr};
+    std::atomic<CacheLineTableL2*> retired_l2{nullptr};
+
+    SlabPool<CacheLineTableL2> l2_pool;
+    SlabPool<CacheLineTableLeaf> leaf_pool;
+
+    // Operations do not nest, so the guard simply overwrites the announced
+    // epoch. The fence orders the announcement before the node loads that
+    // follow, and pairs with the one in quiescent().
+    class ReaderGuard {
+        TrackerReader &reader;
+    public:
+        ReaderGuard(): reader(this_reader()) {
+            reader.epoch.store(global_epoch().load(std::memory_order_acquire), std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+        ~ReaderGuard() {
+            reader.epoch.store(0, std::memory_order_release);
+        }
+    };
 
-public:
-    ~CacheLineTracker() {
-        for (uint64_t i = 0; i < L1_ENTRIES; ++i) {
-            auto* l2 = l1[i].load(std::memory_order_relaxed);
-            if (!l2) continue;
-
-            for (uint64_t j = 0; j < L2_ENTRIES; ++j) {
-                auto* leaf = l2->leaves[j].load(std::memory_order_relaxed);
-                delete leaf;  // OK if nullptr
+    // shared by all trackers, so a thread needs a single record
+    static inline std::atomic<uint64_t> &global_epoch() {
+        static std::atomic<uint64_t> epoch{1};
+        return epoch;
+    }
+
+    static inline std::atomic<TrackerReader*> &reader_list() {
+        static std::atomic<TrackerReader*> head{nullptr};
+        return head;
+    }
+
+    static inline TrackerReader &this_reader() {
+        static __thread TrackerReader *reader = nullptr;
+        if (reader)
+            return *reader;
+        reader = claim_reader();
+        return *reader;
+    }
+
+    // reuse the record of an exited thread or add a new one, records are
+    // never freed since reclaim() may be scanning them
+    static TrackerReader *claim_reader() {
+        struct Release {
+            TrackerReader *reader = nullptr;
+            ~Release() {
+                if (reader)
+                    reader->in_use.store(false, std::memory_order_release);
             }
-            delete l2;
+        };
+        static thread_local Release release;
+
+        auto &head = reader_list();
+        TrackerReader *r = head.load(std::memory_order_acquire);
+        for (; r; r = r->next) {
+            bool expected = false;
+            if (!r->in_use.load(std::memory_order_relaxed) && r->in_use.compare_exchange_strong(expected, true))
+                break;
+        }
+        if (!r) {
+            r = new TrackerReader();
+            r->next = head.load(std::memory_order_relaxed);
+            while (!head.compare_exchange_weak(r->next, r, std::memory_order_release, std::memory_order_relaxed));
         }
+        release.reader = r;
+        return r;
     }
 
+    // advance the epoch after nodes were unlinked, and check that no thread
+    // is still in an operation that started before
+    static bool quiescent() {
+        uint64_t epoch = global_epoch().fetch_add(1) + 1;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for (auto *r = reader_list().load(std::memory_order_acquire); r; r = r->next) {
+            uint64_t e = r->epoch.load(std::memory_order_acquire);
+            if (e && e < epoch)
+                return false;
+        }
+        return true;
+    }
+
+public:
     void mark_dirty(uintptr_t va) {
         uint64_t l1_idx, l2_idx, line;
         split_va(va, l1_idx, l2_idx, line);
-        get_or_create_leaf(l1_idx, l2_idx)->mark_dirty(line);
+        ReaderGuard guard;
+        mark_leaf(l1_idx, l2_idx, 1ull << line);
     }
 
     void mark_dirty(uintptr_t va, uint64_t mask) {
         uint64_t l1_idx, l2_idx, line;
         split_va(va, l1_idx, l2_idx, line);
-        get_or_create_leaf(l1_idx, l2_idx)->mark_dirty_with_mask(mask);
+        ReaderGuard guard;
+        mark_leaf(l1_idx, l2_idx, mask);
     }
 
     bool is_dirty(uintptr_t va) const {
         uint64_t l1_idx, l2_idx, line;
         split_va(va, l1_idx, l2_idx, line);
-        auto* l2 = l1[l1_idx].load(std::memory_order_acquire);
+        if (!l1_summary.test(l1_idx)) return false;
+        ReaderGuard guard;
+        auto* l2 = load_l2(l1_idx);
         if (!l2) return false;
 
         auto* leaf = l2->leaves[l2_idx].load(std::memory_order_acquire);
@@ -124,14 +290,17 @@ public:
     bool invalidate_if_dirty(uintptr_t va) {
         uint64_t l1_idx, l2_idx, line;
         split_va(va, l1_idx, l2_idx, line);
-        auto* l2 = l1[l1_idx].load(std::memory_order_acquire);
+        if (!l1_summary.test(l1_idx)) return false;
+        ReaderGuard guard;
+        auto* l2 = load_l2(l1_idx);
         if (!l2) return false;
 
         auto* leaf = l2->leaves[l2_idx].load(std::memory_order_acquire);
         if (leaf && leaf->is_dirty(line)) {
             do_invalidate((char *)va);
             invalidate_fence();
-            leaf->clear_dirty(line);
+            if (leaf->clear_dirty(line) == (1ull << line))
+                retire_leaf(l1_idx, l2, l2_idx, leaf);
             return true;
         }
         return false;
@@ -140,46 +309,17 @@ public:
 
     bool invalidate_range_if_dirty(uintptr_t begin, uintptr_t end) {
         bool any_dirty = false;
-
-        // Align begin to cache unit boundary
-        uintptr_t addr = begin & ~VIRTUAL_CL_MASK;
-	const unsigned leaf_shift = VIRTUAL_CL_SHIFT + LEAF_BITS;
-
-        while (addr < end) {
-            uint64_t l1_idx, l2_idx, line_idx;
-            split_va(addr, l1_idx, l2_idx, line_idx);
-
-            auto* l2 = l1[l1_idx].load(std::memory_order_acquire);
-            if (!l2) {
-                // Jump to next leaf
-                addr = ((addr >> leaf_shift) + 1) << leaf_shift;
-                continue;
-            }
-
-            auto* leaf = l2->leaves[l2_idx].load(std::memory_order_acquire);
-            if (!leaf) {
-                // Jump to next leaf
-                addr = ((addr >> leaf_shift) + 1) << leaf_shift;
-                continue;
-            }
-
-            // Calculate how many cache lines in this page we need to process
-            uint64_t start_line = line_idx;
-            uint64_t end_line = LEAF_ENTRIES;
-
-            uintptr_t page_end_va = ((addr >> leaf_shift) + 1) << leaf_shift; // next page boundary
-            if (page_end_va > end) {
-                // Clamp to range end
-                end_line = (end >> LEAF_BITS) & (LEAF_ENTRIES - 1);
-            }
-
-            // Construct a mask of all lines in [start_line, end_line)
-            uint64_t mask;
-            if (end_line == LEAF_ENTRIES) {
-                mask = ~0ull << start_line;   // full tail mask
-            } else {
-                mask = ((1ull << end_line) - 1) & ~((1ull << start_line) - 1);
-            }
+        if (begin >= end)
+            return false;
+        const uint64_t leaf_begin = begin >> LEAF_SHIFT;
+        const uint64_t leaf_end = ((end - 1) >> LEAF_SHIFT) + 1;
+        if (!any_l1_marked(leaf_begin, leaf_end))
+            return false;
+
+        ReaderGuard guard;
+        walk_leaves(leaf_begin, leaf_end,
+            [&](uint64_t l1_idx, CacheLineTableL2 *l2, uint64_t l2_idx, CacheLineTableLeaf *leaf, uintptr_t leaf_va) {
+            uint64_t mask = range_mask(leaf_va, begin, end);
 
             // Atomically clear all those bits
             // might allow more parallelism for flushes if all fetch_and are moved to end of function
@@ -188,65 +328,361 @@ public:
 
             if (was_dirty) {
                 any_dirty = true;
+                invalidate_lines(leaf_va, was_dirty);
+            }
+            if (!(prev & ~mask))
+                retire_leaf(l1_idx, l2, l2_idx, leaf);
+            return true;
+        });
 
-                // For each bit set in was_dirty, invalidate that line
-                uint64_t bits = was_dirty;
-                while (bits) {
-                    unsigned bit = __builtin_ctzll(bits);  // index of lowest set bit
-                    uintptr_t line_va = (addr & ~((1ull << leaf_shift) - 1)) + (bit * VIRTUAL_CL_SIZE);
-                    do_invalidate((char*)line_va);
-                    bits &= bits - 1; // clear lowest set bit
-                }
+        if (any_dirty)
+            invalidate_fence();
+        return any_dirty;
+    }
+
+    // Invalidate dirty lines in [begin, end) ahead of user threads, stopping
+    // once about budget lines are invalidated. Unlike invalidate_range_if_dirty,
+    // bits are only cleared after the invalidations are fenced, so a concurrent
+    // reader never finds a line clean before it is invalidated. Must not run
+    // concurrently with mark_dirty. Returns the address where draining stopped.
+    uintptr_t drain_range(uintptr_t begin, uintptr_t end, size_t &budget) {
+        struct Drained {
+            uint64_t l1_idx;
+            CacheLineTableL2 *l2;
+            uint64_t l2_idx;
+            CacheLineTableLeaf *leaf;
+            uint64_t mask;
+        };
+        Drained batch[TRACKER_DRAIN_BATCH];
+        unsigned count = 0;
+
+        auto clear_batch = [&]() {
+            invalidate_fence();
+            for (unsigned i = 0; i < count; i++) {
+                auto &d = batch[i];
+                if (!(d.leaf->clear_dirty_with_mask(d.mask) & ~d.mask))
+                    retire_leaf(d.l1_idx, d.l2, d.l2_idx, d.leaf);
             }
+            count = 0;
+        };
+
+        if (begin >= end || !budget)
+            return begin;
+        const uint64_t leaf_end = ((end - 1) >> LEAF_SHIFT) + 1;
+        if (!any_l1_marked(begin >> LEAF_SHIFT, leaf_end))
+            return end;
+        ReaderGuard guard;
+        uint64_t leaf_num = walk_leaves(begin >> LEAF_SHIFT, leaf_end,
+            [&](uint64_t l1_idx, CacheLineTableL2 *l2, uint64_t l2_idx, CacheLineTableLeaf *leaf, uintptr_t leaf_va) {
+            if (!budget)
+                return false;
+            uint64_t mask = leaf->dirty_mask.load() & range_mask(leaf_va, begin, end);
+            if (!mask)
+                return true;
+            invalidate_lines(leaf_va, mask);
+            size_t lines = __builtin_popcountll(mask);
+            budget -= lines < budget ? lines : budget;
+            batch[count++] = {l1_idx, l2, l2_idx, leaf, mask};
+            if (count == TRACKER_DRAIN_BATCH)
+                clear_batch();
+            return true;
+        });
+        if (count)
+            clear_batch();
+        return leaf_num < leaf_end ? std::max(leaf_num << LEAF_SHIFT, begin) : end;
+    }
 
-            // Advance to next page (next leaf in L2)
-            addr = page_end_va;
+    void mark_range_dirty(uintptr_t begin, uintptr_t end) {
+        if (begin >= end)
+            return;
+        uint64_t leaf_num = begin >> LEAF_SHIFT;
+        const uint64_t leaf_end = ((end - 1) >> LEAF_SHIFT) + 1;
+        ReaderGuard guard;
+        for (; leaf_num < leaf_end; leaf_num++) {
+            uint64_t l1_idx = (leaf_num >> L2_BITS) & (L1_ENTRIES - 1);
+            uint64_t l2_idx = leaf_num & (L2_ENTRIES - 1);
+            mark_leaf(l1_idx, l2_idx, range_mask(leaf_num << LEAF_SHIFT, begin, end));
         }
-
-        return any_dirty;
     }
 
     void clear_dirty(uintptr_t va) {
         uint64_t l1_idx, l2_idx, line;
         split_va(va, l1_idx, l2_idx, line);
-        auto* l2 = l1[l1_idx].load(std::memory_order_acquire);
+        if (!l1_summary.test(l1_idx)) return;
+        ReaderGuard guard;
+        auto* l2 = load_l2(l1_idx);
         if (!l2) return;
 
         auto* leaf = l2->leaves[l2_idx].load(std::memory_order_acquire);
-        if (leaf) leaf->clear_dirty(line);
+        if (leaf && leaf->clear_dirty(line) == (1ull << line))
+            retire_leaf(l1_idx, l2, l2_idx, leaf);
+    }
+
+    // Drop all tracked lines in O(1), for when they are known to be clean,
+    // e.g. after a wbinvd. Must not run concurrently with mark_dirty.
+    void clear_all() {
+        generation.fetch_add(1);
+        live_leaves.store(0, std::memory_order_relaxed);
+        sweep_pos.store(0);
+    }
+
+    // approximate number of leaves holding dirty lines
+    size_t leaf_count() const {
+        int64_t n = live_leaves.load(std::memory_order_relaxed);
+        return n > 0 ? n : 0;
+    }
+
+    // Return retired tables and leaves to the pools once no thread can still
+    // reference them, and retire a batch of stale tables left by clear_all().
+    // Must not be called from within another tracker operation, or by more
+    // than one thread at a time.
+    void reclaim() {
+        sweep_stale();
+        if (!retired.load(std::memory_order_relaxed) && !retired_l2.load(std::memory_order_relaxed))
+            return;
+        CacheLineTableLeaf *batch = retired.exchange(nullptr);
+        CacheLineTableL2 *l2_batch = retired_l2.exchange(nullptr);
+        // every node in the batches was unlinked before this point, so readers
+        // announcing the advanced epoch cannot find them
+        if (!quiescent()) {
+            push_retired(batch);
+            push_retired_l2(l2_batch);
+            return;
+        }
+        while (batch) {
+            auto *next = batch->next_retired;
+            leaf_pool.deallocate(batch);
+            batch = next;
+        }
+        while (l2_batch) {
+            auto *next = l2_batch->next_retired;
+            // leaves unlinked from a stale table are in the leaf batch instead
+            for (auto &slot: l2_batch->leaves)
+                if (auto *leaf = slot.load(std::memory_order_relaxed))
+                    leaf_pool.deallocate(leaf);
+            l2_pool.deallocate(l2_batch);
+            l2_batch = next;
+        }
     }
 
 private:
-    inline CacheLineTableLeaf* get_or_create_leaf(uint64_t l1_idx, uint64_t l2_idx) {
-        auto* l2 = l1[l1_idx].load(std::memory_order_acquire);
-        if (!l2) {
-            auto* new_l2 = new CacheLineTableL2();
-            if (!l1[l1_idx].compare_exchange_strong(l2, new_l2, std::memory_order_acq_rel)) {
-                delete new_l2;
-                l2 = l1[l1_idx].load(std::memory_order_acquire);
-            } else {
+    // the L2 table covering l1_idx, or nullptr if it is absent or stale
+    inline CacheLineTableL2 *load_l2(uint64_t l1_idx) const {
+        auto *l2 = l1[l1_idx].load(std::memory_order_acquire);
+        if (l2 && l2->gen != generation.load(std::memory_order_relaxed))
+            return nullptr;
+        return l2;
+    }
+
+    // summary bits are set bottom-up after the leaf is marked
+    inline void mark_summary(uint64_t l1_idx, CacheLineTableL2 *l2, uint64_t l2_idx) {
+        l2->summary.set(l2_idx);
+        l1_summary.set(l1_idx);
+    }
+
+    inline void mark_leaf(uint64_t l1_idx, uint64_t l2_idx, uint64_t mask) {
+        CacheLineTableL2 *l2;
+        CacheLineTableLeaf *leaf;
+        do {
+            leaf = get_or_create_leaf(l1_idx, l2_idx, l2);
+            leaf->mark_dirty_with_mask(mask);
+            // leaf was retired concurrently and the mark may have been missed, mark again
+        } while (l2->leaves[l2_idx].load() != leaf);
+        mark_summary(l1_idx, l2, l2_idx);
+    }
+
+    // Unlink a leaf found empty so it can be recycled. Bits set by a concurrent
+    // mark_dirty before the unlink are either seen here and re-published, or
+    // the marker sees the unlink and marks again.
+    inline void retire_leaf(uint64_t l1_idx, CacheLineTableL2 *l2, uint64_t l2_idx, CacheLineTableLeaf *leaf) {
+        CacheLineTableLeaf *expected = leaf;
+        if (!l2->leaves[l2_idx].compare_exchange_strong(expected, nullptr))
+            return;
+        if (l2->gen == generation.load(std::memory_order_relaxed))
+            live_leaves.fetch_sub(1, std::memory_order_relaxed);
+        clear_summary(l1_idx, l2, l2_idx);
+        if (uint64_t mask = leaf->dirty_mask.load())
+            mark_leaf(l1_idx, l2_idx, mask);
+        leaf->next_retired = nullptr;
+        push_retired(leaf);
+    }
+
+    inline void push_retired(CacheLineTableLeaf *first) {
+        if (!first)
+            return;
+        CacheLineTableLeaf *last = first;
+        while (last->next_retired)
+            last = last->next_retired;
+        CacheLineTableLeaf *head = retired.load(std::memory_order_relaxed);
+        do {
+            last->next_retired = head;
+        } while (!retired.compare_exchange_weak(head, first));
+    }
+
+    inline void push_retired_l2(CacheLineTableL2 *first) {
+        if (!first)
+            return;
+        CacheLineTableL2 *last = first;
+        while (last->next_retired)
+            last = last->next_retired;
+        CacheLineTableL2 *head = retired_l2.load(std::memory_order_relaxed);
+        do {
+            last->next_retired = head;
+        } while (!retired_l2.compare_exchange_weak(head, first));
+    }
+
+    // Unlink up to TRACKER_SWEEP_BATCH stale tables so memory of older
+    // generations is returned even if those regions are never marked again.
+    inline void sweep_stale() {
+        uint64_t pos = sweep_pos.load();
+        if (pos >= L1_ENTRIES)
+            return;
+        const uint64_t end = std::min(pos + TRACKER_SWEEP_BATCH, L1_ENTRIES);
+        for (uint64_t i = pos; i < end; i++) {
+            // load the table before the generation, so a table created after
+            // a concurrent clear_all() is never seen as stale
+            auto *l2 = l1[i].load(std::memory_order_acquire);
+            if (!l2 || l2->gen == generation.load())
+                continue;
+            if (l1[i].compare_exchange_strong(l2, nullptr)) {
+                clear_l1_summary(i);
+                l2->next_retired = nullptr;
+                push_retired_l2(l2);
+            }
+        }
+        // a concurrent clear_all() restarts the sweep
+        sweep_pos.compare_exchange_strong(pos, end);
+    }
+
+    // Lazily clear summary bits of an empty leaf slot. A concurrent mark_dirty may
+    // have found the bits still set and skipped setting them, so re-check the
+    // child after clearing and restore the bit if it became non-empty.
+    inline void clear_summary(uint64_t l1_idx, CacheLineTableL2 *l2, uint64_t l2_idx) {
+        l2->summary.clear(l2_idx);
+        auto *leaf = l2->leaves[l2_idx].load();
+        if (leaf && !leaf->is_empty()) {
+            l2->summary.set(l2_idx);
+            return;
+        }
+        if (l2->summary.any())
+            return;
+        clear_l1_summary(l1_idx);
+    }
+
+    inline void clear_l1_summary(uint64_t l1_idx) {
+        if (!l1_summary.test(l1_idx))
+            return;
+        l1_summary.clear(l1_idx);
+        auto *l2 = load_l2(l1_idx);
+        if (l2 && l2->summary.any())
+            l1_summary.set(l1_idx);
+    }
+
+    inline CacheLineTableLeaf* get_or_create_leaf(uint64_t l1_idx, uint64_t l2_idx, CacheLineTableL2 *&l2) {
+        l2 = l1[l1_idx].load(std::memory_order_acquire);
+        const uint32_t gen = generation.load(std::memory_order_relaxed);
+        // replace a missing or stale table, the stale one is recycled with its leaves
+        while (!l2 || l2->gen != gen) {
+            auto* new_l2 = l2_pool.allocate(gen);
+            CacheLineTableL2 *old = l2;
+            if (l1[l1_idx].compare_exchange_strong(l2, new_l2, std::memory_order_acq_rel)) {
+                if (old) {
+                    old->next_retired = nullptr;
+                    push_retired_l2(old);
+                }
                 l2 = new_l2;
+            } else {
+                l2_pool.deallocate(new_l2);
             }
         }
 
         auto* leaf = l2->leaves[l2_idx].load(std::memory_order_acquire);
         if (!leaf) {
-            auto* new_leaf = new CacheLineTableLeaf();
+            auto* new_leaf = leaf_pool.allocate();
             if (!l2->leaves[l2_idx].compare_exchange_strong(leaf, new_leaf, std::memory_order_acq_rel)) {
-                delete new_leaf;
+                leaf_pool.deallocate(new_leaf);
                 leaf = l2->leaves[l2_idx].load(std::memory_order_acquire);
             } else {
+                live_leaves.fetch_add(1, std::memory_order_relaxed);
                 leaf = new_leaf;
             }
         }
         return leaf;
     }
 
+    // whether any L2 table covering leaves [leaf_num, leaf_end) may be dirty,
+    // checked without dereferencing tracker nodes
+    inline bool any_l1_marked(uint64_t leaf_num, uint64_t leaf_end) const {
+        uint64_t l1_num = leaf_num >> L2_BITS;
+        const uint64_t l1_end = ((leaf_end - 1) >> L2_BITS) + 1;
+        while (l1_num < l1_end) {
+            uint64_t l1_idx = l1_num & (L1_ENTRIES - 1);
+            uint64_t l1_bits = l1_summary.from(l1_idx);
+            if (l1_bits & 1)
+                return true;
+            l1_num += SummaryBitmap<L1_ENTRIES>::skip(l1_bits, l1_idx);
+        }
+        return false;
+    }
+
+    // Visit the leaves numbered [leaf_num, leaf_end) that may hold dirty lines,
+    // using the summaries to skip clean subtrees. Stops early when visit returns
+    // false, and returns the number of the first leaf not visited.
+    template<typename Visit>
+    inline uint64_t walk_leaves(uint64_t leaf_num, uint64_t leaf_end, Visit &&visit) {
+        while (leaf_num < leaf_end) {
+            uint64_t l1_idx = (leaf_num >> L2_BITS) & (L1_ENTRIES - 1);
+            uint64_t l1_bits = l1_summary.from(l1_idx);
+            if (!(l1_bits & 1)) {
+                // Jump to next L2 table that may be dirty
+                leaf_num = ((leaf_num >> L2_BITS) + SummaryBitmap<L1_ENTRIES>::skip(l1_bits, l1_idx)) << L2_BITS;
+                continue;
+            }
+
+            auto* l2 = load_l2(l1_idx);
+            if (!l2) {
+                clear_l1_summary(l1_idx);
+                leaf_num = ((leaf_num >> L2_BITS) + 1) << L2_BITS;
+                continue;
+            }
+
+            uint64_t l2_idx = leaf_num & (L2_ENTRIES - 1);
+            uint64_t l2_bits = l2->summary.from(l2_idx);
+            if (!(l2_bits & 1)) {
+                // Jump to next leaf that may be dirty
+                leaf_num += SummaryBitmap<L2_ENTRIES>::skip(l2_bits, l2_idx);
+                continue;
+            }
+
+            auto* leaf = l2->leaves[l2_idx].load(std::memory_order_acquire);
+            if (leaf && !visit(l1_idx, l2, l2_idx, leaf, leaf_num << LEAF_SHIFT))
+                break;
+            leaf_num++;
+        }
+        return leaf_num;
+    }
+
+    // invalidate every line of the leaf at leaf_va set in mask, without fencing
+    static inline void invalidate_lines(uintptr_t leaf_va, uint64_t mask) {
+        invalidate_mask((char *)leaf_va, mask);
+    }
+
+    // mask of the lines in the leaf at leaf_va that fall into [begin, end)
+    static inline uint64_t range_mask(uintptr_t leaf_va, uintptr_t begin, uintptr_t end) {
+        uint64_t start_line = begin > leaf_va ? (begin - leaf_va) >> VIRTUAL_CL_SHIFT : 0;
+        uint64_t mask = ~0ull << start_line;
+        if (end - leaf_va < (1ull << LEAF_SHIFT)) {
+            uint64_t end_line = ((end - 1 - leaf_va) >> VIRTUAL_CL_SHIFT) + 1;
+            if (end_line != LEAF_ENTRIES)
+                mask &= (1ull << end_line) - 1;
+        }
+        return mask;
+    }
+
     static inline void split_va(uintptr_t va, uint64_t &l1, uint64_t &l2, uint64_t &line) {
         line = (va >> VIRTUAL_CL_SHIFT) & (LEAF_ENTRIES - 1);          // 6 bit
-	const uintptr_t shift2 = VIRTUAL_CL_SHIFT + LEAF_BITS;
-        l2   = (va >> shift2) & (L2_ENTRIES - 1);                   // 8 bits
-	const uintptr_t shift1 = shift2 + L2_BITS;
+        l2   = (va >> LEAF_SHIFT) & (L2_ENTRIES - 1);                   // 8 bits
+        const uintptr_t shift1 = LEAF_SHIFT + L2_BITS;
         l1   = (va >> shift1) & (L1_ENTRIES - 1);                   // 19 bits
     }
 };
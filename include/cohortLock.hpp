@@ -0,0 +1,68 @@
+#ifndef _COHORT_LOCK_H_
+#define _COHORT_LOCK_H_
+
+#include <atomic>
+#include <sched.h>
+
+#include "config.hpp"
+#include "mcsLock.hpp"
+
+namespace RACoherence {
+
+/*
+ * CohortLock - lock that is passed within a node before other nodes.
+ *
+ * Nodes take turns on a global ticket lock, while threads of a node queue on
+ * the MCS lock of their node. The holder of the global lock passes it along
+ * with its node's lock while threads of its node are waiting, for up to
+ * COHORT_HANDOFF_LIMIT consecutive handoffs, and only then releases it to
+ * other nodes.
+ */
+template<template<typename> class Allocator=std::allocator>
+class CohortLock {
+    struct alignas(CACHE_LINE_SIZE) Cohort {
+        MCSLock<Allocator> local;
+        // only accessed by the holder of local
+        bool global_held = false;
+        unsigned handoffs = 0;
+    };
+
+    // the global lock is released by whichever thread of the holding node releases last
+    std::atomic<unsigned> next_ticket{0};
+    std::atomic<unsigned> now_serving{0};
+    Cohort cohorts[NODE_COUNT];
+
+    inline void unlock_global(Cohort &c) {
+        c.handoffs = 0;
+        c.global_held = false;
+        now_serving.store(now_serving.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+public:
+    // returns whether the lock was passed within the node
+    bool lock(unsigned nid) {
+        Cohort &c = cohorts[nid];
+        c.local.lock();
+        if (c.global_held)
+            return true;
+        unsigned ticket = next_ticket.fetch_add(1, std::memory_order_relaxed);
+        while (now_serving.load(std::memory_order_acquire) != ticket)
+            sched_yield();
+        c.global_held = true;
+        return false;
+    }
+
+    void unlock(unsigned nid) {
+        Cohort &c = cohorts[nid];
+        if (++c.handoffs < COHORT_HANDOFF_LIMIT && c.local.has_successor()) {
+            c.local.unlock();
+            return;
+        }
+        unlock_global(c);
+        c.local.unlock();
+    }
+};
+
+} // RACoherence
+
+#endif
@@ -44,6 +44,18 @@ constexpr unsigned CPU_NUMAS[] = {0, 1};
 
 // number of cache line groups for which a wbinvd is faster than invalidating with clflushopt + mfence
 #define WBINVD_THRESHOLD (2 << 18)
+
+// number of leaves (64 cache lines each) in the lazy invalidation tracker above which
+// the cache agent invalidates the whole cache with wbinvd and clears the tracker instead
+#ifndef TRACKER_WBINVD_THRESHOLD
+#define TRACKER_WBINVD_THRESHOLD (WBINVD_THRESHOLD >> 2)
+#endif
+
+// measure flush, fence and wbinvd costs on init and derive the thresholds above from them
+#ifndef CALIBRATE_ON_INIT
+#define CALIBRATE_ON_INIT 1
+#endif
+
 #ifndef NODE_COUNT
 #define NODE_COUNT 8
 #endif
@@ -70,6 +82,21 @@ constexpr unsigned CPU_NUMAS[] = {0, 1};
 // thread clock merges with location clock instead of overwriting it
 //#define LOCATION_CLOCK_MERGE
 
+// number of rounds a thread blocked on a CXLAtomic or CXLBarrier spins with pause before sleeping in the kernel
+#ifndef WAIT_SPIN_ROUNDS
+#define WAIT_SPIN_ROUNDS 128
+#endif
+
+// CXLMutex is a cohort lock that is passed within a node before it is passed to another node
+#ifndef CXL_MUTEX_COHORT
+#define CXL_MUTEX_COHORT 0
+#endif
+
+// consecutive handoffs of a cohort lock within a node before it is released to other nodes
+#ifndef COHORT_HANDOFF_LIMIT
+#define COHORT_HANDOFF_LIMIT 64
+#endif
+
 // whether turn off RACoherence protocol and use raw stores and loads
 #ifndef PROTOCOL_OFF
 #define PROTOCOL_OFF 0
@@ -80,6 +107,33 @@ constexpr unsigned CPU_NUMAS[] = {0, 1};
 #define NO_FLUSH 0
 #endif
 
+// choose writeback and invalidate instructions by cpuid on init instead of WRITEBACK_INST and INVALIDATE_INST
+#ifndef FLUSH_DISPATCH
+#define FLUSH_DISPATCH !NO_FLUSH
+#endif
+
+// inject CXL read-miss latency, writeback latency and bandwidth into NHC accesses and flushes
+#ifndef CXL_EMULATION
+#define CXL_EMULATION 0
+#endif
+
+// emulated CXL latencies in ns and bandwidth in MB/s (0 for unlimited), overridden
+// at runtime by RAC_EMU_READ_NS, RAC_EMU_WRITEBACK_NS and RAC_EMU_BANDWIDTH_MBPS
+#ifndef CXL_EMU_READ_LATENCY_NS
+#define CXL_EMU_READ_LATENCY_NS 250
+#endif
+#ifndef CXL_EMU_WRITEBACK_LATENCY_NS
+#define CXL_EMU_WRITEBACK_LATENCY_NS 250
+#endif
+#ifndef CXL_EMU_BANDWIDTH_MBPS
+#define CXL_EMU_BANDWIDTH_MBPS 20000
+#endif
+
+// simulate non-coherent NHC memory with a private software cache per process, see ncSim.hpp
+#ifndef NC_SIMULATION
+#define NC_SIMULATION 0
+#endif
+
 // allocate CXL memory from remote NUMA node
 #ifndef CXL_NUMA_MODE
 #define CXL_NUMA_MODE 1
@@ -95,9 +149,88 @@ constexpr unsigned CPU_NUMAS[] = {0, 1};
 #define EAGER_INVALIDATE 1
 #endif
 
+// consumers choose between eager and lazy invalidation per log entry, overrides EAGER_INVALIDATE.
+// mask-based entries and short ranges are invalidated eagerly, longer ranges are tracked lazily
+// unless user threads were sampled reading from them often
+#ifndef HYBRID_INVALIDATE
+#define HYBRID_INVALIDATE 0
+#endif
+
+// minimum number of cache line groups in a length-based entry for lazy invalidation in hybrid mode
+#ifndef HYBRID_LAZY_THRESHOLD
+#define HYBRID_LAZY_THRESHOLD 64
+#endif
+
+// one in this many lazy invalidations by user threads is sampled to find regions read on this node
+#ifndef LAZY_SAMPLE_PERIOD
+#define LAZY_SAMPLE_PERIOD 16
+#endif
+
+// sampled heat above which a region is invalidated eagerly in hybrid mode
+#ifndef HYBRID_HOT_THRESHOLD
+#define HYBRID_HOT_THRESHOLD 4
+#endif
+
+// whether user threads check for lines pending lazy invalidation
+#define LAZY_INVALIDATE (!EAGER_INVALIDATE || HYBRID_INVALIDATE)
+
+// cache agent invalidates lines pending lazy invalidation when idle, regions recently read on this node first
+#ifndef BACKGROUND_INVALIDATE
+#define BACKGROUND_INVALIDATE 1
+#endif
+
+// max number of cache lines invalidated in the background per idle round of the cache agent
+#ifndef BACKGROUND_INVALIDATE_BUDGET
+#define BACKGROUND_INVALIDATE_BUDGET 1024
+#endif
+
+// long length-based entries are invalidated eagerly by several threads, the thread processing
+// the log together with idle cache agents and user threads blocked on consumption
+#ifndef PARALLEL_INVALIDATE
+#define PARALLEL_INVALIDATE 1
+#endif
+
+// minimum number of cache line groups in a length-based entry for parallel invalidation
+#ifndef PARALLEL_INVALIDATE_THRESHOLD
+#define PARALLEL_INVALIDATE_THRESHOLD 1024
+#endif
+
+// number of cache line groups per shard of a range invalidated in parallel
+#ifndef PARALLEL_INVALIDATE_SHARD
+#define PARALLEL_INVALIDATE_SHARD 128
+#endif
+
+// rounds the thread processing the log waits for helpers to finish their shards
+// before it invalidates the unfinished ones itself, e.g. if a helper was descheduled
+#ifndef PARALLEL_INVALIDATE_SPIN
+#define PARALLEL_INVALIDATE_SPIN 4096
+#endif
+
 // pin each cache agent to a core
 #define CACHE_AGENT_AFFINITY
 
+// number of cache agent threads per node
+#ifndef CACHE_AGENT_COUNT
+#define CACHE_AGENT_COUNT 1
+#endif
+
+// number of idle rounds the cache agent spins with pause before waiting for producers
+#ifndef AGENT_SPIN_ROUNDS
+#define AGENT_SPIN_ROUNDS 2048
+#endif
+
+// tsc cycles per umwait of an idle cache agent, and number of umwaits before it sleeps in the kernel
+#ifndef AGENT_UMWAIT_CYCLES
+#define AGENT_UMWAIT_CYCLES 100000
+#endif
+#ifndef AGENT_UMWAIT_ROUNDS
+#define AGENT_UMWAIT_ROUNDS 20
+#endif
+
+// whether log consumption from each node is guarded by a mutex, needed when
+// more than one thread can consume logs from the same node
+#define LOCKED_CONSUME (CONSUME_HELPING || CONSUME_HELP_IN_LOCK || CACHE_AGENT_COUNT > 1)
+
 // whether to use local cacheline table
 #ifndef LOCAL_CL_TABLE
 #define LOCAL_CL_TABLE 1
@@ -0,0 +1,134 @@
+#ifndef _CXL_EMULATOR_H_
+#define _CXL_EMULATOR_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <x86intrin.h>
+
+#include "config.hpp"
+
+namespace RACoherence {
+
+#if CXL_EMULATION
+// number of NHC cache lines a node is modelled to cache, must be power of two
+constexpr size_t EMU_CACHE_LINES = 1ull << 16;
+
+/*
+ * CXLEmulator - injects CXL latency and bandwidth into NHC traffic.
+ *
+ * The node's cache of NHC memory is modelled as a direct-mapped table of line
+ * tags shared by all threads of the process. An access to a line missing from
+ * the table waits for the read latency, and a writeback waits for the
+ * writeback latency. Both also reserve transfer time on a link of the
+ * configured bandwidth, which is shared by all threads of the process, so
+ * the link is saturated by many concurrent transfers. Invalidations drop
+ * lines from the table, so the next access to them misses. A range pays
+ * its latency once, as its lines are transferred back to back.
+ * Delays are busy waits on the tsc.
+ */
+class CXLEmulator {
+    std::atomic<uintptr_t> tags[EMU_CACHE_LINES]{};
+    // tsc at which the link is free of previously reserved transfers
+    std::atomic<uint64_t> link_free{0};
+
+    static inline size_t slot(uintptr_t line) {
+        return (line ^ (line >> 16)) & (EMU_CACHE_LINES - 1);
+    }
+
+    // reserve the link for bytes and wait until they are transferred after latency
+    void transfer(size_t bytes, uint64_t latency) {
+        uint64_t now = __rdtsc();
+        uint64_t done = now + latency;
+        if (cycles_per_byte) {
+            uint64_t cost = bytes * cycles_per_byte;
+            uint64_t prev = link_free.load(std::memory_order_relaxed);
+            uint64_t start;
+            do {
+                start = prev > now ? prev : now;
+            } while (!link_free.compare_exchange_weak(prev, start + cost, std::memory_order_relaxed));
+            if (start + cost > done)
+                done = start + cost;
+        }
+        while (__rdtsc() < done)
+            _mm_pause();
+    }
+
+    // returns whether the line was missing from the modelled cache, and caches it
+    inline bool fill(uintptr_t line) {
+        auto &tag = tags[slot(line)];
+        if (tag.load(std::memory_order_relaxed) == line)
+            return false;
+        tag.store(line, std::memory_order_relaxed);
+        return true;
+    }
+
+public:
+    // delays in tsc cycles, set by cxl_emu_init
+    uint64_t read_cycles = 0;
+    uint64_t writeback_cycles = 0;
+    // tsc cycles per byte transferred, 0 for unlimited bandwidth
+    double cycles_per_byte = 0;
+
+    std::atomic<uint64_t> read_misses{0};
+    std::atomic<uint64_t> writebacks{0};
+
+    // a load or store of the line at va
+    inline void access(uintptr_t va) {
+        if (!fill(va >> CACHE_LINE_SHIFT))
+            return;
+        read_misses.fetch_add(1, std::memory_order_relaxed);
+        transfer(CACHE_LINE_SIZE, read_cycles);
+    }
+
+    void access_range(uintptr_t begin, uintptr_t end) {
+        size_t misses = 0;
+        for (uintptr_t line = begin >> CACHE_LINE_SHIFT; line < (end + CACHE_LINE_MASK) >> CACHE_LINE_SHIFT; line++)
+            misses += fill(line);
+        if (!misses)
+            return;
+        read_misses.fetch_add(misses, std::memory_order_relaxed);
+        transfer(misses * CACHE_LINE_SIZE, read_cycles);
+    }
+
+    // lines in [begin, end) written back, evict if the instruction also invalidates
+    void writeback(uintptr_t begin, uintptr_t end, bool evict) {
+        if (evict)
+            invalidate(begin, end);
+        size_t lines = (end - begin + CACHE_LINE_MASK) >> CACHE_LINE_SHIFT;
+        writebacks.fetch_add(lines, std::memory_order_relaxed);
+        transfer(lines * CACHE_LINE_SIZE, writeback_cycles);
+    }
+
+    void invalidate(uintptr_t begin, uintptr_t end) {
+        for (uintptr_t line = begin >> CACHE_LINE_SHIFT; line < (end + CACHE_LINE_MASK) >> CACHE_LINE_SHIFT; line++) {
+            auto &tag = tags[slot(line)];
+            if (tag.load(std::memory_order_relaxed) == line)
+                tag.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // wbinvd
+    void invalidate_all() {
+        for (auto &tag: tags)
+            tag.store(0, std::memory_order_relaxed);
+    }
+};
+
+inline CXLEmulator cxl_emu;
+
+// set delays from CXL_EMU_* or the RAC_EMU_* environment variables
+void cxl_emu_init(double tsc_per_ns);
+
+void cxl_emu_dump_stats();
+
+static inline void emu_access_range(const void *addr, size_t len) {
+    cxl_emu.access_range((uintptr_t)addr, (uintptr_t)addr + len);
+}
+#else
+static inline void emu_access_range(const void *, size_t) {}
+#endif
+
+} // RACoherence
+
+#endif
@@ -1,10 +1,19 @@
 #ifndef _CXL_MUTEX_H_
 #define _CXL_MUTEX_H_
 
+#include <algorithm>
 #include <atomic>
+#include <cassert>
+#include <cstring>
 #include <thread>
+#include <type_traits>
+#include <utility>
+#include "cohortLock.hpp"
 #include "cxlMalloc.hpp"
 #include "flushUtils.hpp"
+#include "futex.hpp"
+#include "lineRanges.hpp"
+#include "locationClock.hpp"
 #include "mcsLock.hpp"
 #include "threadOps.hpp"
 #include "utils.hpp"
@@ -14,9 +23,69 @@ namespace RACoherence {
 
 using Mutex = MCSLock<CXLHCAllocator>;
 using SharedMutex = MCSSharedLock<CXLHCAllocator>;
+using CohortMutex = CohortLock<CXLHCAllocator>;
 
 extern __thread ThreadOps *thread_ops;
 
+static inline bool is_release(std::memory_order order) {
+    return order == std::memory_order_seq_cst || order == std::memory_order_release || order == std::memory_order_acq_rel;
+}
+
+static inline bool is_acquire(std::memory_order order) {
+    return order == std::memory_order_seq_cst || order == std::memory_order_acquire || order == std::memory_order_acq_rel;
+}
+
+// failure order of a compare-exchange given a single order, as for std::atomic
+static inline std::memory_order cas_failure_order(std::memory_order order) {
+    if (order == std::memory_order_acq_rel)
+        return std::memory_order_acquire;
+    if (order == std::memory_order_release)
+        return std::memory_order_relaxed;
+    return order;
+}
+
+// acquire a location clock, a single entry the thread already has needs no wait
+static inline void acquire_clock(const CompactClock::Snapshot &clock) {
+    if (!clock.inflated() && (!clock.word || thread_ops->get_clock()[clock.node()] >= clock.clock()))
+        return;
+    thread_ops->thread_acquire(clock.expand());
+}
+
+// Read-modify-write op(ok) of a location whose clock is clock. op sets ok to
+// whether it updated the location. An update releases the thread clock with
+// success, and the op acquires the location clock with the order of its
+// outcome. Ops that do neither leave the clock alone.
+template<typename F>
+static inline auto clocked_rmw(LocationClock &clock, F op, std::memory_order success, std::memory_order failure) -> decltype(op(std::declval<bool &>())) {
+    bool ok = true;
+#if PROTOCOL_OFF
+    (void)clock;
+    (void)failure;
+    if (is_release(success))
+        writeback_fence();
+    return op(ok);
+#else
+    bool release = is_release(success);
+    if (!release && !is_acquire(success) && !is_acquire(failure))
+        return op(ok);
+    if (release)
+        thread_ops->thread_release();
+    // the value may change, so even acquire-only updates exclude writers
+    uint32_t s = clock.lock();
+    auto ret = op(ok);
+    if (ok && release)
+        clock.merge(thread_ops->get_clock());
+    bool acquire = is_acquire(ok ? success : failure);
+    LocationClock::Snapshot loc_clock;
+    if (acquire)
+        clock.copy(loc_clock);
+    clock.unlock(s);
+    if (acquire)
+        acquire_clock(loc_clock);
+    return ret;
+#endif
+}
+
 template<typename T>
 class CXLRelaxedAtomic {
 public:
@@ -47,13 +116,89 @@ public:
         return inner->atomic_data.fetch_add(arg, std::memory_order_relaxed);
     };
 
+    inline T fetch_sub(T arg) {
+        return inner->atomic_data.fetch_sub(arg, std::memory_order_relaxed);
+    };
+
+    inline T fetch_and(T arg) {
+        return inner->atomic_data.fetch_and(arg, std::memory_order_relaxed);
+    };
+
+    inline T fetch_or(T arg) {
+        return inner->atomic_data.fetch_or(arg, std::memory_order_relaxed);
+    };
+
+    inline T fetch_xor(T arg) {
+        return inner->atomic_data.fetch_xor(arg, std::memory_order_relaxed);
+    };
+
     inline T exchange(T arg) {
         return inner->atomic_data.exchange(arg, std::memory_order_relaxed);
     };
 
-    inline T compare_exchange_strong(T& expected, T desired) {
+    inline bool compare_exchange_strong(T& expected, T desired) {
         return inner->atomic_data.compare_exchange_strong(expected, desired, std::memory_order_relaxed);
     };
+
+    inline bool compare_exchange_weak(T& expected, T desired) {
+        return inner->atomic_data.compare_exchange_weak(expected, desired, std::memory_order_relaxed);
+    };
+};
+
+/*
+ * CXLFencedAtomic - relaxed atomic that carries the clock of its writer as of
+ * the writer's last release. A producer can publish its writes once with
+ * rac_release_fence and then set several of these with relaxed stores, and a
+ * consumer can gather their clocks with relaxed loads and acquire them once
+ * with rac_acquire_fence.
+ */
+template<typename T>
+class CXLFencedAtomic {
+public:
+    struct InnerData {
+        std::atomic<T> atomic_data;
+        LocationClock clock;
+    };
+private:
+    InnerData *inner;
+
+public:
+    CXLFencedAtomic(): inner(new(cxlhc_malloc(sizeof(InnerData))) InnerData()) {}
+    CXLFencedAtomic(InnerData *ptr): inner(new(ptr) InnerData()) {}
+
+    ~CXLFencedAtomic() {
+        inner->~InnerData();
+        cxlhc_free(inner, sizeof(InnerData));
+    }
+
+    inline void store(T desired) {
+#if PROTOCOL_OFF
+        inner->atomic_data.store(desired, std::memory_order_relaxed);
+#else
+        uint32_t s = inner->clock.lock();
+        inner->clock.release(thread_ops->get_clock());
+        inner->atomic_data.store(desired, std::memory_order_relaxed);
+        inner->clock.unlock(s);
+#endif
+    }
+
+    inline T load() {
+        return inner->atomic_data.load(std::memory_order_relaxed);
+    }
+
+    // also merges the clock the value was stored with into clock
+    inline T load(VectorClock &clock) {
+#if PROTOCOL_OFF
+        (void)clock;
+        return load();
+#else
+        LocationClock::Snapshot stored_clock;
+        T ret = inner->clock.snapshot([this] { return inner->atomic_data.load(std::memory_order_relaxed); }, stored_clock);
+        if (stored_clock.word)
+            clock.merge(stored_clock.expand());
+        return ret;
+#endif
+    }
 };
 
 template<typename T>
@@ -61,12 +206,18 @@ class CXLAtomic {
 public:
     struct InnerData {
         std::atomic<T> atomic_data;
-        VectorClock clock;
-        Mutex mtx;
+        LocationClock clock;
+        WaitQueue waitq;
     };
 private:
     InnerData *inner;
 
+    // read-modify-write op(order) that always updates the location
+    template<typename F>
+    inline T rmw(F op, std::memory_order order) {
+        return clocked_rmw(inner->clock, [&](bool &) { return op(order); }, order, order);
+    }
+
 public:
     CXLAtomic(): inner(new(cxlhc_malloc(sizeof(InnerData))) InnerData()) {}
     CXLAtomic(InnerData *ptr): inner(new(ptr) InnerData()) {}
@@ -77,21 +228,16 @@ public:
     }
 
     inline void store(T desired, std::memory_order order=std::memory_order_seq_cst) {
-        if (order == std::memory_order_seq_cst || order == std::memory_order_release) { 
+        if (is_release(order)) {
 #if PROTOCOL_OFF
             writeback_fence();
             inner->atomic_data.store(desired, order);
 #else
             thread_ops->thread_release();
-            const VectorClock &thread_clock = thread_ops->get_clock();
-            inner->mtx.lock();
-#ifdef LOCATION_CLOCK_MERGE
-            inner->clock.merge(thread_clock);
-#else
-            inner->clock = thread_clock;
-#endif
+            uint32_t s = inner->clock.lock();
+            inner->clock.release(thread_ops->get_clock());
             inner->atomic_data.store(desired, order);
-            inner->mtx.unlock();
+            inner->clock.unlock(s);
 #endif
         }
         else
@@ -100,73 +246,252 @@ public:
 
     inline T load(std::memory_order order=std::memory_order_seq_cst) {
 #if !PROTOCOL_OFF
-        if (order == std::memory_order_seq_cst || order == std::memory_order_acquire) { 
-
-            inner->mtx.lock();
-            char ret = inner->atomic_data.load(order);
-            VectorClock clock = inner->clock;
-            inner->mtx.unlock();
-
-            thread_ops->thread_acquire(clock);
+        if (is_acquire(order)) {
+            LocationClock::Snapshot clock;
+            T ret = inner->clock.snapshot([this]{ return inner->atomic_data.load(std::memory_order_relaxed); }, clock);
+            acquire_clock(clock);
             return ret;
         }
-        else
-            return inner->atomic_data.load(order);
-#else
-        return inner->atomic_data.load(order);
 #endif
+        return inner->atomic_data.load(order);
     };
 
     inline T fetch_add(T arg, std::memory_order order=std::memory_order_seq_cst) {
+        return rmw([&](std::memory_order o) { return inner->atomic_data.fetch_add(arg, o); }, order);
+    };
+
+    inline T fetch_sub(T arg, std::memory_order order=std::memory_order_seq_cst) {
+        return rmw([&](std::memory_order o) { return inner->atomic_data.fetch_sub(arg, o); }, order);
+    };
+
+    inline T fetch_and(T arg, std::memory_order order=std::memory_order_seq_cst) {
+        return rmw([&](std::memory_order o) { return inner->atomic_data.fetch_and(arg, o); }, order);
+    };
+
+    inline T fetch_or(T arg, std::memory_order order=std::memory_order_seq_cst) {
+        return rmw([&](std::memory_order o) { return inner->atomic_data.fetch_or(arg, o); }, order);
+    };
+
+    inline T fetch_xor(T arg, std::memory_order order=std::memory_order_seq_cst) {
+        return rmw([&](std::memory_order o) { return inner->atomic_data.fetch_xor(arg, o); }, order);
+    };
+
+    inline T exchange(T arg, std::memory_order order=std::memory_order_seq_cst) {
+        return rmw([&](std::memory_order o) { return inner->atomic_data.exchange(arg, o); }, order);
+    };
+
+    // releases with success if it succeeds, acquires with the order of the outcome
+    inline bool compare_exchange_strong(T& expected, T desired, std::memory_order success, std::memory_order failure) {
+        return clocked_rmw(inner->clock, [&](bool &ok) {
+            return ok = inner->atomic_data.compare_exchange_strong(expected, desired, success, failure);
+        }, success, failure);
+    }
+
+    inline bool compare_exchange_strong(T& expected, T desired, std::memory_order order=std::memory_order_seq_cst) {
+        return compare_exchange_strong(expected, desired, order, cas_failure_order(order));
+    }
+
+    // never fails spuriously, as the exchange is done under the location's lock
+    inline bool compare_exchange_weak(T& expected, T desired, std::memory_order success, std::memory_order failure) {
+        return compare_exchange_strong(expected, desired, success, failure);
+    }
+
+    inline bool compare_exchange_weak(T& expected, T desired, std::memory_order order=std::memory_order_seq_cst) {
+        return compare_exchange_strong(expected, desired, order, cas_failure_order(order));
+    }
+
+    // blocks until a load with order returns a value other than old
+    inline void wait(T old, std::memory_order order=std::memory_order_seq_cst) {
+        do {
+            inner->waitq.wait_until([&] { return inner->atomic_data.load(std::memory_order_relaxed) != old; });
+        } while (load(order) == old);
+    }
+
+    // wake threads blocked in wait, after a modification
+    inline void notify_one() {
+        inner->waitq.notify(1);
+    }
+
+    inline void notify_all() {
+        inner->waitq.notify();
+    }
+};
+
+/*
+ * 16-byte compare-exchange with cmpxchg16b. std::atomic falls back to
+ * libatomic for 16-byte types, whose locks are private to a process and so
+ * do not exclude other nodes.
+ */
+static inline bool cas16(unsigned __int128 *addr, unsigned __int128 &expected, unsigned __int128 desired) {
+    uint64_t lo = (uint64_t)expected, hi = (uint64_t)(expected >> 64);
+    bool ok;
+    __asm__ volatile("lock cmpxchg16b %1"
+        : "=@ccz"(ok), "+m"(*addr), "+a"(lo), "+d"(hi)
+        : "b"((uint64_t)desired), "c"((uint64_t)(desired >> 64))
+        : "memory");
+    expected = ((unsigned __int128)hi << 64) | lo;
+    return ok;
+}
+
+// Intel and AMD guarantee that aligned 16-byte SSE accesses are atomic on
+// processors that support AVX
+static inline bool has_atomic_load16() {
+    static const bool supported = [] {
+        unsigned a = 1, b, c = 0, d;
+        __asm__ volatile("cpuid" : "+a" (a), "=b" (b), "+c" (c), "=d" (d));
+        return ((c >> 28) & 1) != 0;
+    }();
+    return supported;
+}
+
+// an atomic 16-byte load of an aligned address
+static inline unsigned __int128 load16(unsigned __int128 *addr) {
+    unsigned __int128 val = 0;
+    if (has_atomic_load16()) {
+        __asm__ volatile("movdqa %1, %%xmm0\n\tmovdqu %%xmm0, %0" : "=m"(val) : "m"(*addr) : "xmm0", "memory");
+        return val;
+    }
+    // takes the line exclusive and writes it
+    cas16(addr, val, val);
+    return val;
+}
+
+/*
+ * CXLWideAtomic - CXLAtomic of a 16-byte trivially copyable T, such as a
+ * tagged pointer. Loads are plain SSE loads on processors with AVX. Older
+ * ones have no atomic 16-byte load, so loads there are done with cmpxchg16b
+ * and take the line exclusive like updates do, including acquire polling.
+ */
+template<typename T>
+class CXLWideAtomic {
+    static_assert(sizeof(T) == 16 && std::is_trivially_copyable<T>::value, "CXLWideAtomic needs a 16-byte trivially copyable type");
+public:
+    struct InnerData {
+        alignas(16) unsigned __int128 data = 0;
+        LocationClock clock;
+    };
+private:
+    InnerData *inner;
+
+    static inline unsigned __int128 to_bits(const T &t) {
+        unsigned __int128 bits;
+        std::memcpy(&bits, &t, sizeof(T));
+        return bits;
+    }
+
+    static inline T from_bits(unsigned __int128 bits) {
+        T t;
+        std::memcpy(&t, &bits, sizeof(T));
+        return t;
+    }
+
+    inline bool cas(T &expected, T desired) {
+        unsigned __int128 exp = to_bits(expected);
+        bool ok = cas16(&inner->data, exp, to_bits(desired));
+        expected = from_bits(exp);
+        return ok;
+    }
+
+public:
+    CXLWideAtomic(): inner(new(cxlhc_malloc(sizeof(InnerData))) InnerData()) {}
+    CXLWideAtomic(InnerData *ptr): inner(new(ptr) InnerData()) {}
+
+    ~CXLWideAtomic() {
+        inner->~InnerData();
+        cxlhc_free(inner, sizeof(InnerData));
+    }
+
+    inline T load(std::memory_order order=std::memory_order_seq_cst) {
 #if !PROTOCOL_OFF
-        if (order == std::memory_order_seq_cst || order == std::memory_order_acquire || order == std::memory_order_release || order == std::memory_order_acq_rel) { 
-            char ret;
-            if (order == std::memory_order_seq_cst || order == std::memory_order_acq_rel) { 
-                thread_ops->thread_release();
-                inner->mtx.lock();
-                ret = inner->atomic_data.fetch_add(arg, order);
-                 inner->clock.merge(thread_ops->get_clock());
-                const VectorClock clock = inner->clock;
-                inner->mtx.unlock();
-                thread_ops->thread_acquire(clock);
-            } else if (order == std::memory_order_release) {
-                thread_ops->thread_release();
-                inner->mtx.lock();
-                ret = inner->atomic_data.fetch_add(arg, order);
-                inner->clock.merge(thread_ops->get_clock());
-                inner->mtx.unlock();
-            } else if (order == std::memory_order_acquire){
-                inner->mtx.lock();
-                ret = inner->atomic_data.fetch_add(arg, order);
-                const VectorClock clock = inner->clock;
-                inner->mtx.unlock();
-                thread_ops->thread_acquire(clock);
-            } else
-                ret = inner->atomic_data.fetch_add(arg, order); 
+        if (is_acquire(order)) {
+            LocationClock::Snapshot clock;
+            T ret = inner->clock.snapshot([this]{ return from_bits(load16(&inner->data)); }, clock);
+            acquire_clock(clock);
             return ret;
         }
-        else
-            return inner->atomic_data.fetch_add(arg, order);
-#else
-        if (order == std::memory_order_seq_cst || order == std::memory_order_release || order == std::memory_order_acq_rel)
-            writeback_fence();
-
-        return inner->atomic_data.fetch_add(arg, order);
 #endif
-    };
+#if PROTOCOL_OFF
+        (void)order;
+#endif
+        return from_bits(load16(&inner->data));
+    }
+
+    inline void store(T desired, std::memory_order order=std::memory_order_seq_cst) {
+        exchange(desired, order);
+    }
+
+    inline T exchange(T desired, std::memory_order order=std::memory_order_seq_cst) {
+        return clocked_rmw(inner->clock, [&](bool &) {
+            T expected = from_bits(load16(&inner->data));
+            while (!cas(expected, desired));
+            return expected;
+        }, order, order);
+    }
+
+    // releases with success if it succeeds, acquires with the order of the outcome
+    inline bool compare_exchange_strong(T& expected, T desired, std::memory_order success, std::memory_order failure) {
+        return clocked_rmw(inner->clock, [&](bool &ok) { return ok = cas(expected, desired); }, success, failure);
+    }
+
+    inline bool compare_exchange_strong(T& expected, T desired, std::memory_order order=std::memory_order_seq_cst) {
+        return compare_exchange_strong(expected, desired, order, cas_failure_order(order));
+    }
+
+    inline bool compare_exchange_weak(T& expected, T desired, std::memory_order success, std::memory_order failure) {
+        return compare_exchange_strong(expected, desired, success, failure);
+    }
+
+    inline bool compare_exchange_weak(T& expected, T desired, std::memory_order order=std::memory_order_seq_cst) {
+        return compare_exchange_strong(expected, desired, order, cas_failure_order(order));
+    }
 };
 
 // CXLRelaxedMutex only guarantees coherence of the contained data
+//
+// Writes to the data should be reported with mark_dirty. Unlock writes back
+// only the reported lines and adds them to the stale lines of every other
+// node, and lock invalidates only the lines that are stale for the node.
+// Line ranges are kept exact until a list fills up, then the two closest
+// ranges are coalesced. A holder that took the data with get() but reported
+// nothing is assumed to have written all of it, so unlock then writes back
+// and marks stale the whole data.
 template<typename T, size_t Count>
 class CXLRelaxedMutex {
+    static constexpr size_t SIZE = Count * sizeof(T);
+    // lines spanned by the data if it starts mid-line
+    static constexpr size_t MAX_LINES = (SIZE + CACHE_LINE_MASK) / CACHE_LINE_SIZE + 1;
+    // line ranges recorded per critical section
+    static constexpr unsigned DIRTY_RANGES = 8;
+    // line ranges recorded per node between its critical sections
+    static constexpr unsigned STALE_RANGES = 16;
+
 public:
     struct InnerData {
         Mutex mtx;
-        unsigned owner_node = NODE_COUNT+1;
+        // lines written on other nodes since each node last held the lock,
+        // relative to the line data starts in
+        LineRanges<STALE_RANGES> stale[NODE_COUNT];
+
+        InnerData() {
+            for (auto &s: stale)
+                s.add(0, MAX_LINES);
+        }
     };
 private:
     InnerData *inner;
     T *data;
+    // lines written by the holder
+    LineRanges<DIRTY_RANGES> dirty;
+    // whether the holder took the data pointer since lock
+    bool accessed = false;
+
+    inline char *line_addr(size_t line) {
+        return (char *)(((uintptr_t)data & ~CACHE_LINE_MASK) + (line << CACHE_LINE_SHIFT));
+    }
+
+    inline size_t line_of(const void *addr) {
+        return ((uintptr_t)addr >> CACHE_LINE_SHIFT) - ((uintptr_t)data >> CACHE_LINE_SHIFT);
+    }
 
 public:
     CXLRelaxedMutex(T *d): inner(new(cxlhc_malloc(sizeof(InnerData))) InnerData()), data(d) {}
@@ -179,26 +504,55 @@ public:
 
     inline void lock() {
         inner->mtx.lock();
-#ifndef PROTOCOL_OFF
-        unsigned nid = thread_op->get_node_id();
-        if (inner->owner_node != nid) {
-            do_range_invalidate((char *)&inner->data, Count * sizeof(T));
-            inner->owner_node = nid;
+#if !PROTOCOL_OFF
+        auto &stale = inner->stale[thread_ops->get_node_id()];
+        if (stale.count) {
+            size_t lines = line_of((char *)data + SIZE - 1) + 1;
+            for (unsigned i = 0; i < stale.count; i++) {
+                size_t end = std::min(stale.ranges[i].end, lines);
+                do_range_invalidate(line_addr(stale.ranges[i].begin), (end - stale.ranges[i].begin) << CACHE_LINE_SHIFT);
+            }
+            stale.clear();
             invalidate_fence();
         }
 #else
-        do_range_invalidate((char *)data, Count * sizeof(T));
+        do_range_invalidate((char *)data, SIZE);
         invalidate_fence();
 #endif
     }
 
     inline void unlock() {
-        do_range_writeback((char *)data, Count * sizeof(T));
+#if !PROTOCOL_OFF
+        if (!dirty.count && accessed)
+            dirty.add(0, line_of((char *)data + SIZE - 1) + 1);
+        accessed = false;
+        for (unsigned i = 0; i < dirty.count; i++)
+            do_range_writeback(line_addr(dirty.ranges[i].begin), (dirty.ranges[i].end - dirty.ranges[i].begin) << CACHE_LINE_SHIFT);
         writeback_fence();
+        unsigned nid = thread_ops->get_node_id();
+        for (unsigned n = 0; n < NODE_COUNT; n++) {
+            if (n == nid)
+                continue;
+            for (unsigned i = 0; i < dirty.count; i++)
+                inner->stale[n].add(dirty.ranges[i].begin, dirty.ranges[i].end);
+        }
+        dirty.clear();
+#else
+        do_range_writeback((char *)data, SIZE);
+        writeback_fence();
+#endif
         inner->mtx.unlock();
     }
 
+    // report a write to n elements from p, called by the holder
+    inline void mark_dirty(const T *p, size_t n = 1) {
+        if (!n)
+            return;
+        dirty.add(line_of(p), line_of((const char *)(p + n) - 1) + 1);
+    }
+
     inline T* get() {
+        accessed = true;
         return data;
     }
 };
@@ -206,12 +560,33 @@ public:
 class CXLMutex {
 public:
     struct InnerData{
+#if CXL_MUTEX_COHORT
+        CohortMutex mtx;
+#else
         Mutex mtx;
-        VectorClock clock;
+#endif
+        CompactClock clock;
     };
 private:
     InnerData *inner;
 
+    inline void unlock_mtx() {
+#if CXL_MUTEX_COHORT
+        inner->mtx.unlock(thread_ops->get_node_id());
+#else
+        inner->mtx.unlock();
+#endif
+    }
+
+    inline void publish_clock() {
+        const auto &thread_clock = thread_ops->get_clock();
+#ifdef LOCATION_CLOCK_MERGE
+        inner->clock.merge(thread_clock);
+#else
+        inner->clock.assign(thread_clock);
+#endif
+    }
+
 public:
     CXLMutex(): inner(new(cxlhc_malloc(sizeof(InnerData))) InnerData()) {}
     CXLMutex(InnerData *ptr): inner(new(ptr) InnerData()) {}
@@ -224,14 +599,31 @@ public:
     inline void lock() {
 #if CONSUME_HELP_IN_LOCK
         //TODO: wrap clock with atomics for thread safety
-        VectorClock clock = inner->clock;
+        VectorClock clock = inner->clock.get();
         inner->mtx.lock_with_help(clock);
+#elif CXL_MUTEX_COHORT
+        if (inner->mtx.lock(thread_ops->get_node_id())) {
+#if !PROTOCOL_OFF
+            // passed within the node, so the logs the clock covers are already consumed
+            thread_ops->thread_acquire_local(inner->clock.get());
+#endif
+            return;
+        }
+#elif !PROTOCOL_OFF
+        if (!inner->mtx.try_lock()) {
+            // the holder releases at least the current clock, so its logs
+            // can be consumed while this thread is queued
+            thread_ops->post_demand(inner->clock.peek());
+            inner->mtx.lock();
+        }
 #else
         inner->mtx.lock();
 #endif
 
 #if !PROTOCOL_OFF
-        thread_ops->thread_acquire(inner->clock);
+        CompactClock::Snapshot clock;
+        inner->clock.copy(clock);
+        acquire_clock(clock);
 #endif
     }
 
@@ -240,30 +632,131 @@ public:
         writeback_fence();
 #else
         thread_ops->thread_release(); 
-        const auto &thread_clock = thread_ops->get_clock();
-#ifdef LOCATION_CLOCK_MERGE
-        inner->clock.merge(thread_clock);
-#else
-        inner->clock = thread_clock;
+        publish_clock();
 #endif
+        unlock_mtx();
+    }
+
+    // release only the thread's dirty lines in ranges, the rest stay pending
+    inline void unlock_scoped(const DataRange *ranges, size_t count) {
+#if PROTOCOL_OFF
+        (void)ranges;
+        (void)count;
+        writeback_fence();
+#else
+        thread_ops->thread_release_scoped(ranges, count);
+        publish_clock();
 #endif
-        inner->mtx.unlock();
+        unlock_mtx();
     }
 
     inline void unlock_relaxed() {
-        inner->mtx.unlock();
+        unlock_mtx();
+    }
+};
+
+/*
+ * CXLScopedMutex - CXLMutex that only guarantees coherence of the data it
+ * protects, given as address ranges. Unlock publishes only the dirty lines
+ * of the thread in those ranges, so its other dirty lines stay pending and
+ * the next holder does not wait for them.
+ */
+class CXLScopedMutex {
+    static constexpr size_t MAX_RANGES = 8;
+
+    CXLMutex mtx;
+    DataRange ranges[MAX_RANGES];
+    size_t range_count = 0;
+
+public:
+    CXLScopedMutex() = default;
+    CXLScopedMutex(CXLMutex::InnerData *ptr): mtx(ptr) {}
+
+    CXLScopedMutex(const void *addr, size_t len) {
+        add_range(addr, len);
+    }
+
+    inline void add_range(const void *addr, size_t len) {
+        assert(range_count < MAX_RANGES && "too many ranges for scoped mutex");
+        ranges[range_count++] = DataRange(addr, len);
+    }
+
+    inline void lock() {
+        mtx.lock();
+    }
+
+    inline void unlock() {
+        mtx.unlock_scoped(ranges, range_count);
     }
 };
 
+/*
+ * CXLSharedMutex - reader-biased shared mutex (BRAVO).
+ *
+ * While the lock is read-biased, readers only bump the reader count of their
+ * node, so readers on different nodes touch disjoint lines. Readers that find
+ * the bias revoked bump the count while holding the writer lock. A writer
+ * takes the writer lock, revokes the bias if it is set and waits for the
+ * reader counts to drain, which covers readers of both kinds.
+ * The bias is restored by such readers only after a time proportional to
+ * the last revocation, so frequent writers do not keep paying for it.
+ * Readers release into the clock of their node, which the next writer
+ * acquires together with the clock of the previous writer.
+ */
 class CXLSharedMutex {
+    // the bias is inhibited for this many times the duration of a revocation
+    static constexpr uint64_t BIAS_INHIBIT_FACTOR = 9;
+
 public:
+    struct NodeReaders {
+        std::atomic<unsigned> count{0};
+        LocationClock clock;
+    };
+
     struct InnerData{
-        SharedMutex mtx;
-        VectorClock clock;
+        Mutex mtx;
+        CompactClock clock;
+        std::atomic<bool> read_bias{true};
+        // tsc until which readers do not restore the bias
+        std::atomic<uint64_t> inhibit_until{0};
+        CacheAligned<NodeReaders> readers[NODE_COUNT];
     };
 private:
     InnerData *inner;
 
+    inline NodeReaders &node_readers() {
+        return inner->readers[thread_ops->get_node_id()];
+    }
+
+    // enter as a reader while the lock is read-biased
+    inline bool try_lock_biased(NodeReaders &r) {
+        if (!inner->read_bias.load(std::memory_order_relaxed))
+            return false;
+        r.count.fetch_add(1, std::memory_order_seq_cst);
+        if (inner->read_bias.load(std::memory_order_seq_cst))
+            return true;
+        r.count.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // called with the writer lock held, so no reader enters through it
+    inline void drain_readers() {
+        bool biased = inner->read_bias.load(std::memory_order_relaxed);
+        uint64_t start = 0;
+        if (biased) {
+            start = read_tsc();
+            inner->read_bias.store(false, std::memory_order_seq_cst);
+        }
+        for (auto &r: inner->readers) {
+            while (r.count.load(std::memory_order_seq_cst))
+                cpu_pause();
+        }
+        if (biased) {
+            uint64_t now = read_tsc();
+            inner->inhibit_until.store(now + (now - start) * BIAS_INHIBIT_FACTOR, std::memory_order_relaxed);
+        }
+    }
+
 public:
     CXLSharedMutex(): inner(new(cxlhc_malloc(sizeof(InnerData))) InnerData()) {}
     CXLSharedMutex(void* ptr): inner(new(ptr) InnerData()) {}
@@ -275,32 +768,48 @@ public:
 
     inline void lock() {
 #if !PROTOCOL_OFF
-#if CONSUME_HELP_IN_LOCK 
-        VectorClock clock = inner->clock;
-        inner->mtx.lock_with_help(clock);
-#else
-        inner->mtx.lock_shared();
-        thread_ops->thread_acquire(inner->clock);
-        inner->mtx.unlock_shared();
- 
-        inner->mtx.lock(); 
-        thread_ops->thread_acquire(inner->clock);
-#endif
+        if (!inner->mtx.try_lock()) {
+            thread_ops->post_demand(inner->clock.peek());
+            inner->mtx.lock();
+        }
 #else
         inner->mtx.lock();
+#endif
+        drain_readers();
+
+#if !PROTOCOL_OFF
+        // no readers are left, so the reader clocks are stable
+        VectorClock clock = inner->clock.get();
+        for (auto &r: inner->readers) {
+            LocationClock::Snapshot reader_clock;
+            uint32_t s = r.clock.lock();
+            r.clock.copy(reader_clock);
+            r.clock.clear();
+            r.clock.unlock(s);
+            if (reader_clock.word)
+                clock.merge(reader_clock.expand());
+        }
+        // the release on unlock covers the cleared reader clocks
+        thread_ops->thread_acquire(clock);
 #endif
     }
 
     inline void lock_shared() {
-#if CONSUME_HELP_IN_LOCK && !PROTOCOL_OFF
-        VectorClock clock = inner->clock;
-        inner->mtx.lock_shared_with_help(clock);
-#else
-        inner->mtx.lock_shared();
-#endif
+        NodeReaders &r = node_readers();
+        if (!try_lock_biased(r)) {
+            inner->mtx.lock();
+            r.count.fetch_add(1, std::memory_order_relaxed);
+            if (!inner->read_bias.load(std::memory_order_relaxed) && read_tsc() >= inner->inhibit_until.load(std::memory_order_relaxed))
+                inner->read_bias.store(true, std::memory_order_relaxed);
+            inner->mtx.unlock();
+        }
 
 #if !PROTOCOL_OFF
-        thread_ops->thread_acquire(inner->clock);
+        // writers drain the reader counts before they enter, so the writer
+        // clock does not change while this thread is counted
+        CompactClock::Snapshot clock;
+        inner->clock.copy(clock);
+        acquire_clock(clock);
 #endif
     }
 
@@ -313,126 +822,198 @@ public:
 #ifdef LOCATION_CLOCK_MERGE
         inner->clock.merge(thread_clock);
 #else
-        inner->clock = thread_clock;
+        inner->clock.assign(thread_clock);
 #endif
 #endif
         inner->mtx.unlock();
     }
 
     inline void unlock_shared() {
+        NodeReaders &r = node_readers();
 #if PROTOCOL_OFF
         writeback_fence();
 #else
         thread_ops->thread_release();
-        const auto &thread_clock = thread_ops->get_clock();
-#ifdef LOCATION_CLOCK_MERGE
-        inner->clock.merge(thread_clock);
-#else
-        inner->clock = thread_clock;
-#endif
+        uint32_t s = r.clock.lock();
+        r.clock.merge(thread_ops->get_clock());
+        r.clock.unlock(s);
 #endif
-        inner->mtx.unlock_shared();
+        r.count.fetch_sub(1, std::memory_order_release);
     }
 };
 
+// CXLCondVar - condition variable for CXLMutex, clocks are passed through the mutex
+class CXLCondVar {
+public:
+    struct InnerData {
+        WaitQueue waitq;
+    };
+private:
+    InnerData *inner;
+
+public:
+    CXLCondVar(): inner(new(cxlhc_malloc(sizeof(InnerData))) InnerData()) {}
+    CXLCondVar(InnerData *ptr): inner(new(ptr) InnerData()) {}
+
+    ~CXLCondVar() {
+        inner->~InnerData();
+        cxlhc_free(inner, sizeof(InnerData));
+    }
+
+    // may wake up spuriously
+    inline void wait(CXLMutex &mtx) {
+        uint32_t s = inner->waitq.prepare_wait();
+        mtx.unlock();
+        inner->waitq.sleep(s);
+        inner->waitq.finish_wait();
+        mtx.lock();
+    }
+
+    template<typename Predicate>
+    inline void wait(CXLMutex &mtx, Predicate pred) {
+        while (!pred())
+            wait(mtx);
+    }
+
+    inline void notify_one() {
+        inner->waitq.notify(1);
+    }
+
+    inline void notify_all() {
+        inner->waitq.notify();
+    }
+};
+
+/*
+ * CXLBarrier - combining barrier.
+ *
+ * Threads arrive at the group of their node, or at a single group if the
+ * barrier is not split by node. The last thread to arrive at a group
+ * represents it at the top level, and after the last group has arrived
+ * there, each representative releases the threads of its group. Threads
+ * release into the clock of their group, representatives merge it into the
+ * top clock once per group and bring the merged clock back to their group,
+ * which the threads then acquire, so threads mostly touch lines of their
+ * own node.
+ */
 class CXLBarrier {
-    CXLAtomic<int> target;
-    CXLAtomic<int> arrived;
-    CXLAtomic<int> phase;
+    struct alignas(CACHE_LINE_SIZE) Group {
+        std::atomic<uint32_t> arrived{0};
+        uint32_t target = 0;
+        std::atomic<uint32_t> phase{0};
+        WaitQueue waitq;
+        LocationClock clock;
+    };
 
 public:
-    CXLBarrier() = default;
+    struct InnerData {
+        Group groups[NODE_COUNT];
+        Group top;
+        bool per_node = false;
+    };
+private:
+    InnerData *inner;
+
+    static inline void merge_clock(LocationClock &clock, const VectorClock &other) {
+        uint32_t s = clock.lock();
+        clock.merge(other);
+        clock.unlock(s);
+    }
+
+    static inline LocationClock::Snapshot snapshot_clock(LocationClock &clock) {
+        LocationClock::Snapshot snapshot;
+        clock.snapshot([] { return 0; }, snapshot);
+        return snapshot;
+    }
+
+    // returns whether the caller was the last to arrive, waits for the last one otherwise
+    static inline bool arrive(Group &g, uint32_t phase) {
+        if (g.arrived.fetch_add(1, std::memory_order_acq_rel) + 1 == g.target)
+            return true;
+        g.waitq.wait_until([&] { return g.phase.load(std::memory_order_acquire) != phase; });
+        return false;
+    }
 
-    CXLBarrier(int count) {
+    static inline void depart(Group &g, uint32_t phase) {
+        g.arrived.store(0, std::memory_order_relaxed);
+        g.phase.store(phase + 1, std::memory_order_release);
+        g.waitq.notify();
+    }
+
+    inline void reset() {
+        for (auto &g: inner->groups) {
+            g.target = 0;
+            g.arrived.store(0, std::memory_order_relaxed);
+        }
+        inner->top.arrived.store(0, std::memory_order_relaxed);
+    }
+
+public:
+    CXLBarrier(): inner(new(cxlhc_malloc(sizeof(InnerData))) InnerData()) {}
+
+    CXLBarrier(int count): CXLBarrier() {
         init(count);
     }
 
+    // node_counts[i] threads of node i take part
+    CXLBarrier(const unsigned (&node_counts)[NODE_COUNT]): CXLBarrier() {
+        init(node_counts);
+    }
+
+    ~CXLBarrier() {
+        inner->~InnerData();
+        cxlhc_free(inner, sizeof(InnerData));
+    }
+
     inline void init(int count) {
-        target.store(count, std::memory_order_relaxed);
-        arrived.store(0, std::memory_order_release);
-        phase.store(0, std::memory_order_release);
+        reset();
+        inner->per_node = false;
+        inner->groups[0].target = count;
+        inner->top.target = 1;
+    }
+
+    inline void init(const unsigned (&node_counts)[NODE_COUNT]) {
+        reset();
+        inner->per_node = true;
+        inner->top.target = 0;
+        for (unsigned i = 0; i < NODE_COUNT; i++) {
+            inner->groups[i].target = node_counts[i];
+            inner->top.target += node_counts[i] != 0;
+        }
     }
 
     inline void wait() {
-        int local_phase = phase.load(std::memory_order_acquire);
-
-        int local_arrived = arrived.fetch_add(1, std::memory_order_acq_rel) + 1;
-        if (local_arrived == target.load(std::memory_order_relaxed)) {
-            arrived.store(0, std::memory_order_relaxed);
-            phase.fetch_add(1, std::memory_order_acq_rel);
-        } else {
-            while (phase.load(std::memory_order_acquire) == local_phase) {
-                std::this_thread::yield();
+        Group &g = inner->groups[inner->per_node ? thread_ops->get_node_id() : 0];
+        Group &top = inner->top;
+        uint32_t phase = g.phase.load(std::memory_order_acquire);
+
+#if PROTOCOL_OFF
+        writeback_fence();
+#else
+        thread_ops->thread_release();
+        merge_clock(g.clock, thread_ops->get_clock());
+#endif
+        if (arrive(g, phase)) {
+            if (top.target > 1) {
+                uint32_t top_phase = top.phase.load(std::memory_order_acquire);
+#if !PROTOCOL_OFF
+                merge_clock(top.clock, snapshot_clock(g.clock).expand());
+#endif
+                if (arrive(top, top_phase))
+                    depart(top, top_phase);
+#if !PROTOCOL_OFF
+                merge_clock(g.clock, snapshot_clock(top.clock).expand());
+#endif
             }
+            depart(g, phase);
         }
+
+#if !PROTOCOL_OFF
+        acquire_clock(snapshot_clock(g.clock));
+#endif
     }
 };
 
-// inlined version of CXLBarrier, slower than non-inlined version 
-//class CXLBarrier {
-//    struct InnerData {
-//        std::atomic<int> target;
-//        std::atomic<int> arrived;
-//        std::atomic<int> phase;
-//        VectorClock clock;
-//        SharedMutex mtx;
-//    };
-//    InnerData *inner;
-//
-//public:
-//    CXLBarrier(): inner(new(cxlhc_malloc(sizeof(InnerData))) InnerData()) {}
-//    CXLBarrier(int count): inner(new(cxlhc_malloc(sizeof(InnerData))) InnerData()) {
-//        init(count);
-//    }
-//
-//    inline void init(int count) {
-//        inner->target.store(count, std::memory_order_relaxed);
-//        inner->arrived.store(0, std::memory_order_release);
-//        inner->phase.store(0, std::memory_order_release);
-//    }
-//
-//    inline void wait() {
-//        int local_phase = inner->phase.load(std::memory_order_acquire);
-//        int local_arrived = inner->arrived.fetch_add(1, std::memory_order_acq_rel) + 1;
-//
-//#if PROTOCOL_OFF
-//        writeback_fence();
-//#else
-//        const auto &thread_clock = thread_ops->get_clock();
-//        inner->mtx.lock();
-//#ifdef LOCATION_CLOCK_MERGE
-//        inner->clock.merge(thread_clock);
-//#else
-//        inner->clock = thread_clock;
-//#endif
-//        inner->mtx.unlock();
-//#endif
-//
-//        if (local_arrived == inner->target.load(std::memory_order_relaxed)) {
-//            inner->arrived.store(0, std::memory_order_relaxed);
-//            inner->phase.fetch_add(1, std::memory_order_acq_rel);
-//        } else {
-//            while (inner->phase.load(std::memory_order_acquire) == local_phase) {
-//#if PROTOCOL_OFF
-//                  std::this_thread::yield();
-//#else
-//                  inner->mtx.lock_shared();
-//                  VectorClock clock = inner->clock;
-//                  inner->mtx.unlock_shared();
-//                  thread_ops->thread_acquire(clock);
-//#endif
-//            }
-//        }
-//
-//#if !PROTOCOL_OFF
-//        inner->mtx.lock_shared();
-//        VectorClock clock = inner->clock;
-//        inner->mtx.unlock_shared();
-//        thread_ops->thread_acquire(clock);
-//#endif
-//    }
-//};
-
 } // RACoherence
 
 #endif
@@ -2,13 +2,18 @@
 #define _CACHE_OPS_H_
 
 #include <stdio.h>
+#include <cstddef>
 #include <cstdlib>
+#include <utility>
 #include "config.hpp"
+#include "cxlEmulator.hpp"
+#include "ncSim.hpp"
 
 #define CLFLUSH 1
 #define CLFLUSHOPT 2
 #define CLWB 3
 
+// instructions used when not chosen at runtime by FLUSH_DISPATCH
 #if !NO_FLUSH
 #define WRITEBACK_INST 3
 #define INVALIDATE_INST 2 //may not be CLWB
@@ -17,27 +22,11 @@
 namespace RACoherence {
 
 constexpr long WRITE_LATENCY_IN_NS = 0;
+// assumed tsc frequency, replaced by the measured one on init if CALIBRATE_ON_INIT
 constexpr long CPU_FREQ_MHZ = 2100;
 
-static inline void do_writeback(char *ptr)
-{
-#if WRITEBACK_INST == CLFLUSH
-    __asm__ volatile("clflush %0" : "+m" (*(volatile char *)ptr));
-#elif WRITEBACK_INST == CLFLUSHOPT
-    __asm__ volatile(".byte 0x66; clflush %0" : "+m" (*(volatile char *)ptr));
-#elif WRITEBACK_INST == CLWB
-    __asm__ volatile(".byte 0x66; xsaveopt %0" : "+m" (*(volatile char *)ptr));
-#endif
-}
-
-static inline void do_invalidate(char *ptr)
-{
-#if INVALIDATE_INST == CLFLUSH
-    __asm__ volatile("clflush %0" : "+m" (*(volatile char *)ptr));
-#elif INVALIDATE_INST == CLFLUSHOPT
-    __asm__ volatile(".byte 0x66; clflush %0" : "+m" (*(volatile char *)ptr));
-#endif
-}
+// tsc cycles of emulated write latency per flushed line
+inline unsigned long write_latency_cycles = WRITE_LATENCY_IN_NS * CPU_FREQ_MHZ / 1000;
 
 static inline void cpu_pause()
 {
@@ -55,35 +44,310 @@ static inline unsigned long read_tsc(void)
     return var;
 }
 
-inline void do_range_writeback(char *data, int len)
+// flush one cache line with instruction Inst
+template<int Inst>
+static inline void flush_line(char *ptr)
 {
-#if !NO_FLUSH
-    char *ptr = (char *)((unsigned long)data & ~CACHE_LINE_MASK);
-    for (; ptr < data+len; ptr += CACHE_LINE_SIZE){
-        unsigned long etsc = read_tsc() +
-            (unsigned long)(WRITE_LATENCY_IN_NS * CPU_FREQ_MHZ/1000);
-        do_writeback(ptr);
-        while (read_tsc() < etsc) cpu_pause();
+    if constexpr (Inst == CLFLUSH)
+        __asm__ volatile("clflush %0" : "+m" (*(volatile char *)ptr));
+    else if constexpr (Inst == CLFLUSHOPT)
+        __asm__ volatile(".byte 0x66; clflush %0" : "+m" (*(volatile char *)ptr));
+    else if constexpr (Inst == CLWB)
+        __asm__ volatile(".byte 0x66; xsaveopt %0" : "+m" (*(volatile char *)ptr));
+}
+
+// number of lines flushed per iteration of range kernels without latency emulation
+constexpr size_t FLUSH_UNROLL = 8;
+
+template<int Inst, size_t... I>
+static inline void flush_unrolled(char *ptr, std::index_sequence<I...>)
+{
+    (flush_line<Inst>(ptr + I * CACHE_LINE_SIZE), ...);
+}
+
+// flush every cache line in [begin, end) with instruction Inst, begin must be line aligned.
+// With EmulateLatency, each flush takes at least write_latency_cycles
+template<int Inst, bool EmulateLatency = (WRITE_LATENCY_IN_NS != 0)>
+void flush_lines(char *begin, char *end)
+{
+    char *ptr = begin;
+    if constexpr (EmulateLatency) {
+        for (; ptr < end; ptr += CACHE_LINE_SIZE) {
+            unsigned long etsc = read_tsc() + write_latency_cycles;
+            flush_line<Inst>(ptr);
+            while (read_tsc() < etsc) cpu_pause();
+        }
+    } else {
+        constexpr size_t STRIDE = FLUSH_UNROLL * CACHE_LINE_SIZE;
+        for (; end - ptr >= (ptrdiff_t)STRIDE; ptr += STRIDE)
+            flush_unrolled<Inst>(ptr, std::make_index_sequence<FLUSH_UNROLL>());
+        for (; ptr < end; ptr += CACHE_LINE_SIZE)
+            flush_line<Inst>(ptr);
+    }
+}
+
+// flush the virtual cache lines at ptr set in mask with instruction Inst,
+// ptr must be virtual line aligned
+template<int Inst, bool EmulateLatency = (WRITE_LATENCY_IN_NS != 0)>
+void flush_mask(char *ptr, uint64_t mask)
+{
+    while (mask) {
+        char *line = ptr + ((uintptr_t)__builtin_ctzll(mask) << VIRTUAL_CL_SHIFT);
+        for (unsigned i = 0; i < CL_EXPAND_FACTOR; i++) {
+            if constexpr (EmulateLatency) {
+                unsigned long etsc = read_tsc() + write_latency_cycles;
+                flush_line<Inst>(line + i * CACHE_LINE_SIZE);
+                while (read_tsc() < etsc) cpu_pause();
+            } else {
+                flush_line<Inst>(line + i * CACHE_LINE_SIZE);
+            }
+        }
+        mask &= mask - 1;
     }
+}
+
+using FlushLinesFn = void (*)(char *, char *);
+using FlushMaskFn = void (*)(char *, uint64_t);
+
+#if FLUSH_DISPATCH
+// instructions chosen by init_flush_dispatch, CLFLUSH is supported everywhere until then
+inline int writeback_inst = CLFLUSH;
+inline int invalidate_inst = CLFLUSH;
+inline FlushLinesFn writeback_lines_fn = flush_lines<CLFLUSH>;
+inline FlushLinesFn invalidate_lines_fn = flush_lines<CLFLUSH>;
+inline FlushMaskFn writeback_mask_fn = flush_mask<CLFLUSH>;
+inline FlushMaskFn invalidate_mask_fn = flush_mask<CLFLUSH>;
+#elif !NO_FLUSH
+constexpr int writeback_inst = WRITEBACK_INST;
+constexpr int invalidate_inst = INVALIDATE_INST;
+#else
+constexpr int writeback_inst = 0;
+constexpr int invalidate_inst = 0;
+#endif
+
+static inline void do_writeback(char *ptr)
+{
+#if CXL_EMULATION
+    cxl_emu.writeback((uintptr_t)ptr, (uintptr_t)ptr + 1, writeback_inst != CLWB);
+#endif
+#if NC_SIMULATION
+    nc_sim_writeback(ptr, ptr + 1, writeback_inst != CLWB);
+#endif
+#if FLUSH_DISPATCH
+    if (writeback_inst == CLWB)
+        flush_line<CLWB>(ptr);
+    else if (writeback_inst == CLFLUSHOPT)
+        flush_line<CLFLUSHOPT>(ptr);
+    else
+        flush_line<CLFLUSH>(ptr);
+#elif !NO_FLUSH
+    flush_line<WRITEBACK_INST>(ptr);
+#else
+    (void)ptr;
 #endif
 }
 
-inline void do_range_invalidate(char *data, int len)
+static inline void do_invalidate(char *ptr)
 {
-#if !NO_FLUSH
-    char *ptr = (char *)((unsigned long)data & ~CACHE_LINE_MASK);
-    for (; ptr < data+len; ptr += CACHE_LINE_SIZE){
-        unsigned long etsc = read_tsc() +
-            (unsigned long)(WRITE_LATENCY_IN_NS * CPU_FREQ_MHZ/1000);
-        do_invalidate(ptr);
-        while (read_tsc() < etsc) cpu_pause();
+#if CXL_EMULATION
+    cxl_emu.invalidate((uintptr_t)ptr, (uintptr_t)ptr + 1);
+#endif
+#if NC_SIMULATION
+    nc_sim_invalidate(ptr, ptr + 1);
+#endif
+#if FLUSH_DISPATCH
+    if (invalidate_inst == CLFLUSHOPT)
+        flush_line<CLFLUSHOPT>(ptr);
+    else
+        flush_line<CLFLUSH>(ptr);
+#elif !NO_FLUSH
+    static_assert(INVALIDATE_INST != CLWB, "CLWB may not invalidate");
+    flush_line<INVALIDATE_INST>(ptr);
+#else
+    (void)ptr;
+#endif
+}
+
+// write back every cache line in [begin, end), begin must be line aligned
+static inline void writeback_lines(char *begin, char *end)
+{
+#if CXL_EMULATION
+    cxl_emu.writeback((uintptr_t)begin, (uintptr_t)end, writeback_inst != CLWB);
+#endif
+#if NC_SIMULATION
+    nc_sim_writeback(begin, end, writeback_inst != CLWB);
+#endif
+#if FLUSH_DISPATCH
+    writeback_lines_fn(begin, end);
+#elif !NO_FLUSH
+    flush_lines<WRITEBACK_INST>(begin, end);
+#else
+    (void)begin;
+    (void)end;
+#endif
+}
+
+// invalidate every cache line in [begin, end), begin must be line aligned
+static inline void invalidate_lines(char *begin, char *end)
+{
+#if CXL_EMULATION
+    cxl_emu.invalidate((uintptr_t)begin, (uintptr_t)end);
+#endif
+#if NC_SIMULATION
+    nc_sim_invalidate(begin, end);
+#endif
+#if FLUSH_DISPATCH
+    invalidate_lines_fn(begin, end);
+#elif !NO_FLUSH
+    flush_lines<INVALIDATE_INST>(begin, end);
+#else
+    (void)begin;
+    (void)end;
+#endif
+}
+
+// write back the virtual cache lines at ptr set in mask, ptr must be virtual line aligned
+static inline void writeback_mask(char *ptr, uint64_t mask)
+{
+#if CXL_EMULATION || NC_SIMULATION
+    for (uint64_t m = mask; m; m &= m - 1) {
+        char *line = ptr + ((uintptr_t)__builtin_ctzll(m) << VIRTUAL_CL_SHIFT);
+#if CXL_EMULATION
+        cxl_emu.writeback((uintptr_t)line, (uintptr_t)line + VIRTUAL_CL_SIZE, writeback_inst != CLWB);
+#endif
+#if NC_SIMULATION
+        nc_sim_writeback(line, line + VIRTUAL_CL_SIZE, writeback_inst != CLWB);
+#endif
+    }
+#endif
+#if FLUSH_DISPATCH
+    writeback_mask_fn(ptr, mask);
+#elif !NO_FLUSH
+    flush_mask<WRITEBACK_INST>(ptr, mask);
+#else
+    (void)ptr;
+    (void)mask;
+#endif
+}
+
+// invalidate the virtual cache lines at ptr set in mask, ptr must be virtual line aligned
+static inline void invalidate_mask(char *ptr, uint64_t mask)
+{
+#if CXL_EMULATION || NC_SIMULATION
+    for (uint64_t m = mask; m; m &= m - 1) {
+        char *line = ptr + ((uintptr_t)__builtin_ctzll(m) << VIRTUAL_CL_SHIFT);
+#if CXL_EMULATION
+        cxl_emu.invalidate((uintptr_t)line, (uintptr_t)line + VIRTUAL_CL_SIZE);
+#endif
+#if NC_SIMULATION
+        nc_sim_invalidate(line, line + VIRTUAL_CL_SIZE);
+#endif
     }
 #endif
+#if FLUSH_DISPATCH
+    invalidate_mask_fn(ptr, mask);
+#elif !NO_FLUSH
+    flush_mask<INVALIDATE_INST>(ptr, mask);
+#else
+    (void)ptr;
+    (void)mask;
+#endif
+}
+
+// ebx and ecx of cpuid leaf 7, zeros if the leaf is not supported
+static inline void cpuid_leaf7(unsigned &ebx, unsigned &ecx)
+{
+    unsigned a = 0, b, c = 0, d;
+    __asm__ volatile("cpuid" : "+a" (a), "=b" (b), "+c" (c), "=d" (d));
+    if (a < 7) {
+        ebx = ecx = 0;
+        return;
+    }
+    a = 7, c = 0;
+    __asm__ volatile("cpuid" : "+a" (a), "=b" (b), "+c" (c), "=d" (d));
+    ebx = b, ecx = c;
+}
+
+// whether the cpu supports user-level monitor/wait (WAITPKG)
+static inline bool has_waitpkg()
+{
+    static const bool supported = [] {
+        unsigned b, c;
+        cpuid_leaf7(b, c);
+        return ((c >> 5) & 1) != 0;
+    }();
+    return supported;
+}
+
+static inline bool has_clflushopt()
+{
+    static const bool supported = [] {
+        unsigned b, c;
+        cpuid_leaf7(b, c);
+        return ((b >> 23) & 1) != 0;
+    }();
+    return supported;
+}
+
+static inline bool has_clwb()
+{
+    static const bool supported = [] {
+        unsigned b, c;
+        cpuid_leaf7(b, c);
+        return ((b >> 24) & 1) != 0;
+    }();
+    return supported;
+}
+
+#if FLUSH_DISPATCH
+// pick the best writeback and invalidate instructions the cpu supports, called once on init
+static inline void init_flush_dispatch()
+{
+    if (has_clwb()) {
+        writeback_inst = CLWB;
+        writeback_lines_fn = flush_lines<CLWB>;
+        writeback_mask_fn = flush_mask<CLWB>;
+    } else if (has_clflushopt()) {
+        writeback_inst = CLFLUSHOPT;
+        writeback_lines_fn = flush_lines<CLFLUSHOPT>;
+        writeback_mask_fn = flush_mask<CLFLUSHOPT>;
+    }
+    if (has_clflushopt()) {
+        invalidate_inst = CLFLUSHOPT;
+        invalidate_lines_fn = flush_lines<CLFLUSHOPT>;
+        invalidate_mask_fn = flush_mask<CLFLUSHOPT>;
+    }
+}
+#endif
+
+// arm address monitoring on the cache line of addr, requires WAITPKG
+static inline void cpu_umonitor(const volatile void *addr)
+{
+    __asm__ volatile(".byte 0xf3, 0x0f, 0xae, 0xf0" :: "a" (addr) : "memory"); // umonitor %rax
+}
+
+// wait in C0.2 until the monitored line is written or the tsc reaches deadline, requires WAITPKG
+static inline void cpu_umwait(unsigned long deadline)
+{
+    __asm__ volatile(".byte 0xf2, 0x0f, 0xae, 0xf1" // umwait %ecx
+                     :: "c" (0), "a" ((unsigned)deadline), "d" ((unsigned)(deadline >> 32)) : "memory", "cc");
+}
+
+inline void do_range_writeback(char *data, size_t len)
+{
+    char *ptr = (char *)((uintptr_t)data & ~CACHE_LINE_MASK);
+    writeback_lines(ptr, data + len);
+}
+
+inline void do_range_invalidate(char *data, size_t len)
+{
+    char *ptr = (char *)((uintptr_t)data & ~CACHE_LINE_MASK);
+    invalidate_lines(ptr, data + len);
 }
 
 static inline void writeback_fence()
 {
-#if WRITEBACK_INST == CLFLUSHOPT || WRITEBACK_INST == CLWB
+#if FLUSH_DISPATCH || WRITEBACK_INST == CLFLUSHOPT || WRITEBACK_INST == CLWB
     __asm__ volatile("sfence":::"memory");
 #endif
 }
@@ -96,6 +360,12 @@ static inline void invalidate_fence()
 }
 
 static inline void wbinvd() {
+#if CXL_EMULATION
+    cxl_emu.invalidate_all();
+#endif
+#if NC_SIMULATION
+    nc_sim_invalidate_all();
+#endif
 #if !NO_FLUSH
     FILE *fd = fopen(WBINVD_PATH, "r");
     if (fd == nullptr) {
@@ -0,0 +1,83 @@
+#ifndef _FUTEX_H_
+#define _FUTEX_H_
+
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+#include "config.hpp"
+
+namespace RACoherence {
+
+// futex words may live in memory shared between processes, so the
+// non-private futex operations are used
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex word must be 32 bits");
+
+// blocks while *addr == val, returns early on wake, signal, or timeout
+static inline long futex_wait(std::atomic<uint32_t> *addr, uint32_t val, const struct timespec *timeout = nullptr) {
+    return syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), FUTEX_WAIT, val, timeout, nullptr, 0);
+}
+
+// wakes up to n threads blocked on addr
+static inline long futex_wake(std::atomic<uint32_t> *addr, int n = INT_MAX) {
+    return syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), FUTEX_WAKE, n, nullptr, nullptr, 0);
+}
+
+// Threads in any process block on a WaitQueue in shared memory until a
+// condition holds. Waiters announce themselves before checking the condition
+// one last time, so notifiers only bump seq and issue a futex wake when a
+// thread may be waiting.
+struct WaitQueue {
+    std::atomic<uint32_t> seq{0};
+    std::atomic<uint32_t> waiters{0};
+
+    // announce a waiter, returns the sequence to sleep on
+    inline uint32_t prepare_wait() {
+        waiters.fetch_add(1);
+        return seq.load(std::memory_order_acquire);
+    }
+
+    // sleeps unless notified since prepare_wait returned s
+    inline void sleep(uint32_t s) {
+        futex_wait(&seq, s);
+    }
+
+    inline void finish_wait() {
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // spins for WAIT_SPIN_ROUNDS, then sleeps until ready() holds
+    template<typename F>
+    inline void wait_until(F ready) {
+        for (unsigned i = 0; i < WAIT_SPIN_ROUNDS; i++) {
+            if (ready())
+                return;
+            _mm_pause();
+        }
+        while (!ready()) {
+            uint32_t s = prepare_wait();
+            if (!ready())
+                sleep(s);
+            finish_wait();
+        }
+    }
+
+    // wakes up to n waiters, after the condition has been made to hold
+    inline void notify(int n = INT_MAX) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!waiters.load(std::memory_order_relaxed))
+            return;
+        seq.fetch_add(1);
+        futex_wake(&seq, n);
+    }
+};
+
+} // RACoherence
+
+#endif
@@ -12,6 +12,7 @@ struct GlobalMeta {
     std::atomic<bool> started;
     std::atomic<unsigned> curr_tid;
     LogManager log_mgrs[NODE_COUNT];
+    Doorbell doorbells[NODE_COUNT];
     void *user_root;
     CXLBarrier root_barrier;
     AllocMeta alloc_meta;
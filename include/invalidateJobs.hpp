@@ -0,0 +1,125 @@
+#ifndef _INVALIDATE_JOBS_H_
+#define _INVALIDATE_JOBS_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+
+#include "clGroup.hpp"
+#include "config.hpp"
+#include "flushUtils.hpp"
+
+namespace RACoherence {
+
+/*
+ * InvalidateJobs - splits eager invalidation of a long range across threads.
+ *
+ * The thread processing a log posts the range as a job of fixed-size shards
+ * and invalidates shards itself. Idle cache agents and user threads blocked
+ * on consumption call help() to take shards too. Shards are claimed by
+ * bumping the ticket, which also carries the job sequence so a helper never
+ * claims a shard of a job other than the one it read. Every thread fences
+ * its own flushes before marking its shard done with the job sequence, so
+ * the range is invalid in this node's caches once all shards are done. A
+ * helper may be descheduled while it holds a shard, so the poster only
+ * waits PARALLEL_INVALIDATE_SPIN rounds and then invalidates the shards not
+ * marked done itself. Helpers finishing late only mark shards of a closed
+ * job. One job runs at a time, a range posted while another is running is
+ * invalidated inline.
+ */
+class InvalidateJobs {
+    static constexpr uintptr_t SHARD_SIZE = (uintptr_t)PARALLEL_INVALIDATE_SHARD << cl_group::GROUP_SHIFT;
+    // longer ranges are split into larger shards
+    static constexpr uint32_t MAX_SHARDS = 1024;
+
+    std::atomic<bool> posted{false};
+    // job sequence in the upper half, odd while the job is open, next shard in the lower half
+    std::atomic<uint64_t> ticket{0};
+    // job sequence in the upper half, shards done in the lower half
+    std::atomic<uint64_t> done{0};
+    // job sequence that last finished each shard
+    std::atomic<uint32_t> shard_done[MAX_SHARDS]{};
+    // written before the ticket opens the job and stable until it is closed
+    std::atomic<uintptr_t> begin{0};
+    std::atomic<uintptr_t> end{0};
+    std::atomic<uintptr_t> shard_size{0};
+    std::atomic<uint32_t> shard_count{0};
+
+    inline void invalidate_shard(uintptr_t b, uintptr_t e, uintptr_t size, uint32_t i) {
+        uintptr_t sb = b + i * size;
+        invalidate_lines((char *)sb, (char *)std::min(sb + size, e));
+    }
+
+    // claim and invalidate one shard, returns false if none is left
+    bool take_shard() {
+        uint64_t t = ticket.load(std::memory_order_acquire);
+        uintptr_t b, e, size;
+        do {
+            // the job is read before the claim, which fails if it was replaced
+            b = begin.load(std::memory_order_relaxed);
+            e = end.load(std::memory_order_relaxed);
+            size = shard_size.load(std::memory_order_relaxed);
+            if (!((t >> 32) & 1) || (uint32_t)t >= shard_count.load(std::memory_order_relaxed))
+                return false;
+        } while (!ticket.compare_exchange_weak(t, t + 1, std::memory_order_acquire));
+        const uint32_t seq = t >> 32;
+        invalidate_shard(b, e, size, (uint32_t)t);
+        invalidate_fence();
+        shard_done[(uint32_t)t].store(seq, std::memory_order_release);
+        uint64_t d = done.load(std::memory_order_relaxed);
+        while (d >> 32 == seq && !done.compare_exchange_weak(d, d + 1, std::memory_order_release, std::memory_order_relaxed));
+        return true;
+    }
+
+public:
+    static inline bool is_large(uintptr_t b, uintptr_t e) {
+        return e - b >= ((uintptr_t)PARALLEL_INVALIDATE_THRESHOLD << cl_group::GROUP_SHIFT);
+    }
+
+    // invalidate [b, e) with the help of other threads, returns once all of it is fenced
+    void invalidate(uintptr_t b, uintptr_t e) {
+        if (posted.exchange(true, std::memory_order_acquire)) {
+            invalidate_lines((char *)b, (char *)e);
+            return;
+        }
+        uintptr_t shards = (e - b + SHARD_SIZE - 1) / SHARD_SIZE;
+        uintptr_t size = SHARD_SIZE * ((shards + MAX_SHARDS - 1) / MAX_SHARDS);
+        uint32_t count = (e - b + size - 1) / size;
+        uint64_t seq = (ticket.load(std::memory_order_relaxed) >> 32) + 1;
+        begin.store(b, std::memory_order_relaxed);
+        end.store(e, std::memory_order_relaxed);
+        shard_size.store(size, std::memory_order_relaxed);
+        shard_count.store(count, std::memory_order_relaxed);
+        done.store(seq << 32, std::memory_order_relaxed);
+        ticket.store(seq << 32, std::memory_order_release);
+
+        while (take_shard());
+        for (unsigned rounds = 0; (uint32_t)done.load(std::memory_order_acquire) < count; rounds++) {
+            if (rounds < PARALLEL_INVALIDATE_SPIN) {
+                cpu_pause();
+                continue;
+            }
+            // invalidating a shard twice is harmless, waiting on a descheduled helper is not
+            for (uint32_t i = 0; i < count; i++)
+                if (shard_done[i].load(std::memory_order_acquire) != (uint32_t)seq)
+                    invalidate_shard(b, e, size, i);
+            invalidate_fence();
+            break;
+        }
+
+        ticket.store((seq + 1) << 32, std::memory_order_relaxed);
+        posted.store(false, std::memory_order_release);
+    }
+
+    // take shards of the running job if any, returns whether it did
+    bool help() {
+        bool helped = false;
+        while (take_shard())
+            helped = true;
+        return helped;
+    }
+};
+
+} // RACoherence
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef _LINE_RANGES_H_
+#define _LINE_RANGES_H_
+
+#include <algorithm>
+#include <cstddef>
+
+namespace RACoherence {
+
+/*
+ * LineRanges - sorted, disjoint and non-adjacent ranges of cache lines.
+ *
+ * Ranges that overlap or touch an added range are merged with it. Up to Cap
+ * ranges are kept exact, a range added while full takes the spare slot and
+ * the two closest ranges are then coalesced, so the list over-approximates
+ * the lines added but never misses one.
+ */
+template<unsigned Cap>
+struct LineRanges {
+    struct Range {
+        size_t begin;
+        size_t end;
+    };
+    // one spare slot for a range added while full
+    Range ranges[Cap + 1];
+    unsigned count = 0;
+
+    void add(size_t begin, size_t end) {
+        unsigned i = 0;
+        while (i < count && ranges[i].end < begin)
+            i++;
+        unsigned j = i;
+        while (j < count && ranges[j].begin <= end) {
+            begin = std::min(begin, ranges[j].begin);
+            end = std::max(end, ranges[j].end);
+            j++;
+        }
+        // replace the ranges [i, j) it overlaps or touches with one
+        if (j == i) {
+            std::move_backward(ranges + i, ranges + count, ranges + count + 1);
+            count++;
+        } else {
+            std::move(ranges + j, ranges + count, ranges + i + 1);
+            count -= j - i - 1;
+        }
+        ranges[i] = {begin, end};
+        if (count <= Cap)
+            return;
+        unsigned closest = 0;
+        for (unsigned k = 1; k + 1 < count; k++) {
+            if (ranges[k + 1].begin - ranges[k].end < ranges[closest + 1].begin - ranges[closest].end)
+                closest = k;
+        }
+        ranges[closest].end = ranges[closest + 1].end;
+        std::move(ranges + closest + 2, ranges + count, ranges + closest + 1);
+        count--;
+    }
+
+    void clear() {
+        count = 0;
+    }
+};
+
+} // RACoherence
+
+#endif
@@ -11,6 +11,15 @@
 
 namespace RACoherence {
 
+// byte range of data, from begin up to end
+struct DataRange {
+    uintptr_t begin;
+    uintptr_t end;
+
+    DataRange() = default;
+    DataRange(const void *addr, size_t len): begin((uintptr_t)addr), end((uintptr_t)addr + len) {}
+};
+
 class LocalCLTable {
     constexpr static size_t GROUP_LEN_MIN = 4; //only saves ranges of at least 4 cache line groups
     /** Each entry here can store 16 cache line units. */
@@ -214,6 +223,56 @@ public:
          return ret;
     }
 
+    // remove the parts of entries that overlap ranges and call f on them,
+    // mask entries only give up their lines in ranges, length-based entries
+    // are taken whole
+    template<typename F>
+    inline void take_overlapping(const DataRange *ranges, size_t count, F f) {
+        using namespace cl_group;
+        for (auto &entry: table) {
+            if (!entry)
+                continue;
+            uintptr_t ptr = get_ptr(entry);
+            if (is_length_based(entry)) {
+                uintptr_t end = ptr + (get_length(entry) << GROUP_SHIFT);
+                for (size_t i = 0; i < count; i++) {
+                    if (ranges[i].begin < end && ranges[i].end > ptr) {
+                        f(entry);
+                        entry = 0;
+                        length_entry_count--;
+                        break;
+                    }
+                }
+                continue;
+            }
+            uint64_t in_range = 0;
+            for (size_t i = 0; i < count; i++) {
+                uintptr_t begin = std::max(ranges[i].begin, ptr);
+                uintptr_t end = std::min<uintptr_t>(ranges[i].end, ptr + (1ull << GROUP_SHIFT));
+                if (begin >= end)
+                    continue;
+                unsigned first = (begin - ptr) >> VIRTUAL_CL_SHIFT;
+                unsigned last = (end - 1 - ptr) >> VIRTUAL_CL_SHIFT;
+                in_range |= ((2ull << last) - 1) & ~((1ull << first) - 1);
+            }
+            uint64_t mask = get_mask16(entry);
+            uint64_t taken = mask & in_range;
+            if (!taken)
+                continue;
+            cl_group_idx index = get_index(entry);
+            f(index | (taken << GROUP_INDEX_SHIFT));
+            uint64_t rest = mask & ~taken;
+            entry = rest ? index | (rest << GROUP_INDEX_SHIFT) : 0;
+        }
+    }
+
+    inline bool is_empty() {
+        for (auto entry: table)
+            if (entry)
+                return false;
+        return true;
+    }
+
     inline int get_length_entry_count() {
         return length_entry_count;
     }
@@ -0,0 +1,208 @@
+#ifndef _LOCATION_CLOCK_H_
+#define _LOCATION_CLOCK_H_
+
+#include <atomic>
+#include <cstdint>
+
+#include "config.hpp"
+#include "cxlMalloc.hpp"
+#include "flushUtils.hpp"
+#include "vectorClock.hpp"
+
+namespace RACoherence {
+
+/*
+ * CompactClock - clock of a synchronization location in one word.
+ *
+ * A clock with a single non-zero entry, as released by threads that have
+ * only synchronized with their own node, is held as (node, clock) in one
+ * word. Any other clock inflates to a full vector allocated out of line,
+ * which is kept for reuse if the clock later becomes single again. Writers
+ * must be serialized by the owner of the clock.
+ */
+class CompactClock {
+    static constexpr uint64_t INFLATED = 1ull << 63;
+
+    // 0 for the zero clock, INFLATED if held in full, otherwise node << 32 | clock
+    std::atomic<uint64_t> word{0};
+    std::atomic<VectorClock *> full{nullptr};
+
+    static inline uint64_t single(unsigned node, vc_clock_t clk) {
+        return ((uint64_t)node << 32) | clk;
+    }
+
+    // word of clock if it has at most one non-zero entry, INFLATED otherwise
+    static inline uint64_t compact(const VectorClock &clock) {
+        uint64_t w = 0;
+        for (unsigned i = 0; i < NODE_COUNT; i++) {
+            if (!clock[i])
+                continue;
+            if (w)
+                return INFLATED;
+            w = single(i, clock[i]);
+        }
+        return w;
+    }
+
+    inline void inflate(const VectorClock &clock) {
+        VectorClock *f = full.load(std::memory_order_relaxed);
+        if (!f) {
+            f = new(cxlhc_malloc(sizeof(VectorClock))) VectorClock();
+            full.store(f, std::memory_order_release);
+        }
+        *f = clock;
+        word.store(INFLATED, std::memory_order_release);
+    }
+
+public:
+    // a copy of a compact clock, full is only set if the clock is inflated
+    struct Snapshot {
+        uint64_t word = 0;
+        VectorClock full;
+
+        inline bool inflated() const { return word == INFLATED; }
+        inline unsigned node() const { return word >> 32; }
+        inline vc_clock_t clock() const { return (vc_clock_t)word; }
+
+        inline VectorClock expand() const {
+            if (inflated())
+                return full;
+            VectorClock clock;
+            if (word)
+                clock.assign(node(), this->clock());
+            return clock;
+        }
+    };
+
+    CompactClock() = default;
+    CompactClock(const CompactClock &) = delete;
+    CompactClock &operator=(const CompactClock &) = delete;
+
+    ~CompactClock() {
+        if (VectorClock *f = full.load(std::memory_order_relaxed))
+            cxlhc_free(f, sizeof(VectorClock));
+    }
+
+    inline void assign(const VectorClock &clock) {
+        uint64_t w = compact(clock);
+        if (w == INFLATED)
+            inflate(clock);
+        else
+            word.store(w, std::memory_order_release);
+    }
+
+    inline void merge(const VectorClock &clock) {
+        uint64_t cur = word.load(std::memory_order_relaxed);
+        uint64_t w = compact(clock);
+        if (w != INFLATED && cur != INFLATED && (!cur || !w || cur >> 32 == w >> 32)) {
+            // both single on the same node
+            word.store(cur > w ? cur : w, std::memory_order_release);
+            return;
+        }
+        VectorClock merged = cur == INFLATED ? *full.load(std::memory_order_relaxed) : VectorClock();
+        if (cur && cur != INFLATED)
+            merged.assign(cur >> 32, (vc_clock_t)cur);
+        merged.merge(clock);
+        inflate(merged);
+    }
+
+    inline void clear() {
+        word.store(0, std::memory_order_release);
+    }
+
+    inline void copy(Snapshot &s) const {
+        s.word = word.load(std::memory_order_acquire);
+        if (s.inflated())
+            s.full = *full.load(std::memory_order_acquire);
+    }
+
+    inline VectorClock get() const {
+        Snapshot s;
+        copy(s);
+        return s.expand();
+    }
+
+    // the clock if it is held in one word, the zero clock if it is inflated.
+    // Only reads the word, so it may race with writers, e.g. as a hint of
+    // the clock a queued thread will acquire.
+    inline VectorClock peek() const {
+        Snapshot s;
+        s.word = word.load(std::memory_order_relaxed);
+        return s.inflated() ? VectorClock() : s.expand();
+    }
+};
+
+/*
+ * LocationClock - clock of a synchronization location in HC memory.
+ *
+ * The clock, together with the value of the location, is published under a
+ * sequence counter that is odd while a writer updates them. Writers
+ * serialize by making the counter odd, while readers take a snapshot and
+ * retry if the counter changed, so they do not write to the location.
+ */
+class LocationClock {
+    std::atomic<uint32_t> seq{0};
+    CompactClock clock;
+
+public:
+    using Snapshot = CompactClock::Snapshot;
+
+    // returns the even sequence the update started from
+    inline uint32_t lock() {
+        uint32_t s = seq.load(std::memory_order_relaxed);
+        while ((s & 1) || !seq.compare_exchange_weak(s, s + 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+            cpu_pause();
+            s = seq.load(std::memory_order_relaxed);
+        }
+        return s;
+    }
+
+    inline void unlock(uint32_t s) {
+        seq.store(s + 2, std::memory_order_release);
+    }
+
+    // the following four must be called with the lock held
+
+    // a release store to the location
+    inline void release(const VectorClock &thread_clock) {
+#ifdef LOCATION_CLOCK_MERGE
+        clock.merge(thread_clock);
+#else
+        clock.assign(thread_clock);
+#endif
+    }
+
+    // a release read-modify-write, which continues the release sequence
+    inline void merge(const VectorClock &thread_clock) {
+        clock.merge(thread_clock);
+    }
+
+    inline void clear() {
+        clock.clear();
+    }
+
+    inline void copy(Snapshot &out) const {
+        clock.copy(out);
+    }
+
+    // consistent snapshot of the clock and of what read returns
+    template<typename F>
+    inline auto snapshot(F read, Snapshot &out) -> decltype(read()) {
+        while (true) {
+            uint32_t s = seq.load(std::memory_order_acquire);
+            if (s & 1) {
+                cpu_pause();
+                continue;
+            }
+            auto ret = read();
+            clock.copy(out);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seq.load(std::memory_order_relaxed) == s)
+                return ret;
+        }
+    }
+};
+
+} // RACoherence
+
+#endif
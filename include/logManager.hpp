@@ -11,6 +11,7 @@
 
 #include "config.hpp"
 #include "cxlMalloc.hpp"
+#include "futex.hpp"
 #include "logger.hpp"
 #include "mcsLock.hpp"
 #include "spmcQueue.hpp"
@@ -56,6 +57,43 @@ public:
 };
 
 
+static_assert(NODE_COUNT <= 64, "doorbell has one bit per node");
+
+// Doorbell of a subscriber node, in hardware coherent memory so producers on
+// any node can ring it. Producers set their bit after publishing a log, so
+// cache agents poll this one line instead of every log, and only visit logs
+// whose bits they claimed. Idle agents wait on the same line: producers bump
+// seq when agents are waiting, and only issue a futex wake when one of them
+// is asleep in the kernel.
+struct alignas(CACHE_LINE_SIZE) Doorbell {
+    // one bit per producer node with logs that may be unconsumed
+    std::atomic<uint64_t> pending{0};
+    std::atomic<uint32_t> seq{0};
+    // agents waiting in user space or in the kernel
+    std::atomic<uint32_t> waiting{0};
+    // agents waiting in the kernel
+    std::atomic<uint32_t> sleeping{0};
+
+    inline void ring(unsigned producer) {
+        // also orders the publish before checking for waiting agents,
+        // which announce themselves before checking pending one last time
+        pending.fetch_or(1ull << producer);
+        if (!waiting.load())
+            return;
+        seq.fetch_add(1);
+        if (sleeping.load())
+            futex_wake(&seq);
+    }
+
+    // take the bits in mask, returns the ones that were set
+    inline uint64_t claim(uint64_t mask) {
+        uint64_t bits = pending.load(std::memory_order_relaxed) & mask;
+        if (!bits)
+            return 0;
+        return pending.fetch_and(~bits) & bits;
+    }
+};
+
 //TODO: tail, gc_mtx, freelist, next_round can be put into process-local memory
 class alignas(CACHE_LINE_SIZE) LogManager {
 public:
@@ -92,6 +130,9 @@ private:
 
     unsigned node_id;
 
+    // doorbells of all nodes, indexed by subscriber
+    Doorbell *doorbells;
+
     idx_t bound = next_round(0);
 
     static idx_t next_round(idx_t idx) {
@@ -149,7 +190,7 @@ private:
 
 public:
 
-    LogManager(unsigned nid): node_id(nid) {
+    LogManager(unsigned nid, Doorbell *d): node_id(nid), doorbells(d) {
         for (unsigned i = 0; i < LOG_COUNT; i++) {
             pub[i].log.store(&buf[i], std::memory_order_relaxed);
             auto ok = freelist.enqueue(&buf[i]);
@@ -212,9 +253,18 @@ public:
         entry.is_rel = r;
         entry.log.store(l, std::memory_order_relaxed);
         entry.idx.store(t+1, std::memory_order_release);
+        ring_subscribers();
         return (vc_clock_t)t+1;
     }
 
+    inline void ring_subscribers() {
+        for (unsigned i = 0; i < NODE_COUNT; i++) {
+            if (i == node_id || !is_subscribed(i))
+                continue;
+            doorbells[i].ring(node_id);
+        }
+    }
+
     //only allows exclusive access on each node 
     const PubEntry *take_head(unsigned nid) {
         //return head, check if overlaps with tail
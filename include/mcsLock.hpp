@@ -83,6 +83,11 @@ public:
         next->locked.store(false, std::memory_order_release);
     }
 
+    // whether another thread is queued behind the holder, only called by the holder
+    bool has_successor() const {
+        return owner->next.load(std::memory_order_acquire) || tail.load(std::memory_order_acquire) != owner;
+    }
+
     void lock() {
         MCSNode *node = alloc.allocate(1);
         lock_with_node(node);
@@ -0,0 +1,53 @@
+#ifndef _NC_SIM_H_
+#define _NC_SIM_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "config.hpp"
+
+namespace RACoherence {
+
+/*
+ * Non-coherence simulation - runs the protocol against a software cache.
+ *
+ * NHC memory is mapped at CXL_NHC_START as private memory of the process,
+ * which acts as its node's cache, while the shared segment is mapped
+ * elsewhere as the memory behind it. Instrumented accesses fill missing
+ * lines from memory, stores mark lines dirty, and only writebacks and
+ * invalidations move data between the cache and memory, so a missing
+ * writeback or invalidation in the protocol shows up as lost or stale data
+ * instead of being hidden by hardware coherence. Lines are never evicted.
+ * NHC data must only be accessed through instrumented accesses.
+ *
+ * Counts hits, misses, stale reads (hits on clean lines that differ from
+ * memory), writebacks and invalidations.
+ */
+#if NC_SIMULATION
+// cache is mapped at CXL_NHC_START, mem is the shared segment behind it
+void nc_sim_init(char *cache, char *mem, size_t range);
+
+// before a load or store of [addr, addr + len)
+void nc_sim_access(const void *addr, size_t len);
+
+// after a store to [addr, addr + len)
+void nc_sim_stored(const void *addr, size_t len);
+
+// write back dirty lines in [begin, end), and drop them if evict
+void nc_sim_writeback(const void *begin, const void *end, bool evict);
+
+// write back dirty lines in [begin, end) and drop them, as clflush does
+void nc_sim_invalidate(const void *begin, const void *end);
+
+// wbinvd
+void nc_sim_invalidate_all();
+
+void nc_sim_dump_stats();
+#else
+static inline void nc_sim_access(const void *, size_t) {}
+static inline void nc_sim_stored(const void *, size_t) {}
+#endif
+
+} // RACoherence
+
+#endif
@@ -5,6 +5,7 @@
 #include "flushUtils.hpp"
 #include "cxlMalloc.hpp"
 #include "cxlSync.hpp"
+#include "ncSim.hpp"
 #include "threadOps.hpp"
 
 #if __cplusplus
@@ -41,6 +42,22 @@ void* rac_get_user_root();
 
 CXLBarrier *rac_get_root_barrier();
 
+// publish the thread's writes so far, for stores to CXLFencedAtomic that follow
+void rac_release_fence();
+
+// acquire the clocks gathered by loads from CXLFencedAtomic, waiting once for all of them
+template<typename... Clocks>
+inline void rac_acquire_fence(const VectorClock &clock, const Clocks &... clocks) {
+#if !PROTOCOL_OFF
+    VectorClock merged = clock;
+    (merged.merge(clocks), ...);
+    thread_ops->thread_acquire(merged);
+#else
+    (void)clock;
+    ((void)clocks, ...);
+#endif
+}
+
 // no threads on the current node can access SWC memory when calling rac_subscribe_to_node
 void rac_subscribe_to_node(unsigned target);
 
@@ -57,10 +74,30 @@ inline bool in_cxl_nhc_mem(void *addr) {
     return ((uintptr_t)addr >= CXL_NHC_START);
 }
 
+// called before NHC memory in [addr, addr + len) is loaded or stored
+inline void nhc_pre_access(const void *addr, size_t len) {
+    emu_access_range(addr, len);
+    nc_sim_access(addr, len);
+}
+
+// called after NHC memory in [addr, addr + len) is stored
+inline void nhc_post_store(const void *addr, size_t len) {
+    nc_sim_stored(addr, len);
+}
+
 inline void rac_post_writeback(void *begin, void *end) {
-#if PROTOCOL_OFF || EAGER_WRITEBACK
+#if NC_SIMULATION
     if (in_cxl_nhc_mem((char*)begin))
-        do_range_writeback((char *)begin, (char *)end - (char *)begin);
+        nhc_post_store(begin, (char *)end - (char *)begin);
+#endif
+#if PROTOCOL_OFF || EAGER_WRITEBACK
+    if (in_cxl_nhc_mem((char*)begin)) {
+        size_t len = (char *)end - (char *)begin;
+        if (len >= flush_policy.wbinvd_writeback_bytes)
+            wbinvd();
+        else
+            do_range_writeback((char *)begin, len);
+    }
 #endif
 #if !PROTOCOL_OFF
     if (in_cxl_nhc_mem((char*)begin))
@@ -83,15 +120,19 @@ inline void invalidate_boundaries(char *begin, char *end) {
 #if PROTOCOL_OFF
         do_invalidate(end);
 #else
-        check_invalidate(begin);
+        check_invalidate(end);
 #endif
 }
 
 inline void rac_store_pre_invalidate(void *begin, void *end) {
-#if PROTOCOL_OFF || !EAGER_INVALIDATE
+#if PROTOCOL_OFF || LAZY_INVALIDATE
     if (in_cxl_nhc_mem((char*)begin))
         invalidate_boundaries((char*)begin, (char*)end);
 #endif
+#if CXL_EMULATION || NC_SIMULATION
+    if (in_cxl_nhc_mem((char*)begin))
+        nhc_pre_access(begin, (char*)end-(char*)begin);
+#endif
 }
 
 inline void rac_load_pre_invalidate(void *begin, void *end) {
@@ -99,10 +140,14 @@ inline void rac_load_pre_invalidate(void *begin, void *end) {
     if (in_cxl_nhc_mem((char*)begin))
         do_range_invalidate((char*)begin, (char*)end-(char*)begin);
 #endif
-#if !EAGER_INVALIDATE
+#if LAZY_INVALIDATE
     if (in_cxl_nhc_mem((char*)begin))
         check_range_invalidate((char*)begin, (char*)end);
 #endif
+#if CXL_EMULATION || NC_SIMULATION
+    if (in_cxl_nhc_mem((char*)begin))
+        nhc_pre_access(begin, (char*)end-(char*)begin);
+#endif
 }
 
 } // RACoherence
@@ -116,12 +161,15 @@ using namespace RACoherence;
         if (in_cxl_nhc_mem(addr)) { \
             do_invalidate((char *)addr); \
             invalidate_fence(); \
+            nhc_pre_access(addr, sizeof(uint ## size ## _t)); \
         } \
         return *((uint ## size ## _t*)addr); \
     }
-#elif EAGER_INVALIDATE
+#elif !LAZY_INVALIDATE
 #define RACLOAD(size) \
     inline __attribute__((used)) uint ## size ## _t rac_load ## size(void * addr, const char * /*position*/) { \
+        if ((CXL_EMULATION || NC_SIMULATION) && in_cxl_nhc_mem(addr)) \
+            nhc_pre_access(addr, sizeof(uint ## size ## _t)); \
         return *((uint ## size ## _t*)addr); \
     }
 #else
@@ -129,6 +177,7 @@ using namespace RACoherence;
     inline __attribute__((used)) uint ## size ## _t rac_load ## size(void * addr, const char * /*position*/) { \
         if (in_cxl_nhc_mem(addr)) { \
             check_invalidate((char *)addr); \
+            nhc_pre_access(addr, sizeof(uint ## size ## _t)); \
         } \
         return *((uint ## size ## _t*)addr); \
     }
@@ -141,19 +190,25 @@ using namespace RACoherence;
         if (in_cxl_nhc) { \
             do_invalidate((char *)addr); \
             invalidate_fence(); \
+            nhc_pre_access(addr, sizeof(uint ## size ## _t)); \
         } \
         *((uint ## size ## _t*)addr) = val; \
-        if (in_cxl_nhc) \
+        if (in_cxl_nhc) { \
+            nhc_post_store(addr, sizeof(uint ## size ## _t)); \
             do_writeback((char *)addr); \
+        } \
     }
-#elif EAGER_INVALIDATE
+#elif !LAZY_INVALIDATE
 #define RACSTORE(size) \
     inline __attribute__((used)) void rac_store ## size(void * addr, uint ## size ## _t val, const char * /*position*/) {  \
         bool in_cxl_nhc = in_cxl_nhc_mem(addr); \
         if (in_cxl_nhc) { \
             thread_ops->log_store((char *)addr); \
+            nhc_pre_access(addr, sizeof(uint ## size ## _t)); \
         } \
         *((uint ## size ## _t*)addr) = val; \
+        if (NC_SIMULATION && in_cxl_nhc) \
+            nhc_post_store(addr, sizeof(uint ## size ## _t)); \
     }
 #else 
 #define RACSTORE(size) \
@@ -162,8 +217,11 @@ using namespace RACoherence;
         if (in_cxl_nhc) { \
             check_invalidate((char *)addr); \
             thread_ops->log_store((char *)addr); \
+            nhc_pre_access(addr, sizeof(uint ## size ## _t)); \
         } \
         *((uint ## size ## _t*)addr) = val; \
+        if (NC_SIMULATION && in_cxl_nhc) \
+            nhc_post_store(addr, sizeof(uint ## size ## _t)); \
     }
 #endif
 
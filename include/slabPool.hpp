@@ -0,0 +1,102 @@
+#ifndef _SLAB_POOL_H_
+#define _SLAB_POOL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <numa.h>
+
+#include "config.hpp"
+#include "mcsLock.hpp"
+
+namespace RACoherence {
+
+/*
+ * SlabPool - fixed-size object allocator backed by NUMA-local chunks.
+ *
+ * Objects are carved out of large chunks allocated on LOCAL_NUMA_NODE_ID and
+ * recycled through an intrusive free list, so steady-state allocation never
+ * calls malloc. Chunks are only returned to the OS when the pool is destroyed.
+ * It is thread-safe, allocation and deallocation are serialized by a lock.
+ */
+template<typename T, size_t ChunkSize = (1ull << 21)>
+class SlabPool {
+    struct FreeNode {
+        FreeNode *next;
+    };
+
+    struct ChunkHeader {
+        ChunkHeader *next;
+    };
+
+    static_assert(sizeof(T) >= sizeof(FreeNode), "object too small for free list");
+
+    static constexpr size_t OBJ_SIZE = (sizeof(T) + alignof(T) - 1) & ~(alignof(T) - 1);
+    static constexpr size_t HEADER_SIZE = (sizeof(ChunkHeader) + alignof(T) - 1) & ~(alignof(T) - 1);
+    static constexpr size_t OBJS_PER_CHUNK = (ChunkSize - HEADER_SIZE) / OBJ_SIZE;
+    static_assert(OBJS_PER_CHUNK > 0, "chunk too small for object");
+
+    MCSLock<> mtx;
+    FreeNode *free_list = nullptr;
+    ChunkHeader *chunks = nullptr;
+    // bump pointer into the most recent chunk
+    char *bump = nullptr;
+    char *bump_end = nullptr;
+
+    void add_chunk() {
+        void *mem = numa_alloc_onnode(ChunkSize, LOCAL_NUMA_NODE_ID);
+        if (!mem) {
+            std::bad_alloc exception;
+            throw exception;
+        }
+        auto *header = static_cast<ChunkHeader *>(mem);
+        header->next = chunks;
+        chunks = header;
+        bump = static_cast<char *>(mem) + HEADER_SIZE;
+        bump_end = bump + OBJS_PER_CHUNK * OBJ_SIZE;
+    }
+
+public:
+    SlabPool() = default;
+    SlabPool(const SlabPool &) = delete;
+    SlabPool &operator=(const SlabPool &) = delete;
+
+    ~SlabPool() {
+        while (chunks) {
+            ChunkHeader *next = chunks->next;
+            numa_free(chunks, ChunkSize);
+            chunks = next;
+        }
+    }
+
+    template<typename... Args>
+    T *allocate(Args&&... args) {
+        void *mem;
+        {
+            UniqueLock<> lk(mtx);
+            if (free_list) {
+                mem = free_list;
+                free_list = free_list->next;
+            } else {
+                if (bump == bump_end)
+                    add_chunk();
+                mem = bump;
+                bump += OBJ_SIZE;
+            }
+        }
+        return new(mem) T(static_cast<Args&&>(args)...);
+    }
+
+    // the caller must make sure no other thread still references obj
+    void deallocate(T *obj) {
+        obj->~T();
+        auto *node = reinterpret_cast<FreeNode *>(obj);
+        UniqueLock<> lk(mtx);
+        node->next = free_list;
+        free_list = node;
+    }
+};
+
+} // RACoherence
+
+#endif
@@ -24,6 +24,7 @@ class ThreadOps {
     VectorClock thread_clock;
     LocalCLTable dirty_cls;
     uintptr_t recent_cl = 0;
+    bool has_pending = false; // stored lines not yet released
     Log *curr_log = nullptr;
 
     inline void set_to_new_log(Log *& log) {
@@ -42,53 +43,66 @@ class ThreadOps {
         curr_log->write(cl);
     }
 
-    vc_clock_t write_to_log(bool is_release) {
-        using namespace cl_group;
-        vc_clock_t clk_val = 0;
+    // log entries are written to, kept across writes to the log under DELAY_PUBLISH
+    inline Log *&open_log(Log *&local_log) {
 #if DELAY_PUBLISH
+        (void)local_log;
         if (!curr_log)
             set_to_new_log(curr_log);
+        return curr_log;
 #else
-        Log *curr_log;
-        set_to_new_log(curr_log);
+        set_to_new_log(local_log);
+        return local_log;
 #endif
+    }
 
-        for(auto entry: dirty_cls) {
-            if (!entry)
-                continue;
+    inline void log_entry(Log *&log, cl_group_t entry, bool is_release) {
+        using namespace cl_group;
 #if DELAY_PUBLISH
-            if (curr_log->is_full()) {
-                clk_val = log_mgrs[node_id].produce_tail(curr_log, is_release);
-                STATS(cache_info->produced_count++;)
-                LOG_DEBUG("node " << node_id << " produce log " << cache_info->produced_count)
-                set_to_new_log(curr_log);
-            }
+        if (log->is_full()) {
+            log_mgrs[node_id].produce_tail(log, is_release);
+            STATS(cache_info->produced_count++;)
+            LOG_DEBUG("node " << node_id << " produce log " << cache_info->produced_count)
+            set_to_new_log(log);
+        }
+#else
+        (void)is_release;
 #endif
-            curr_log->write(entry);
+        log->write(entry);
 #if !EAGER_WRITEBACK
-            if (is_length_based(entry)) {
-                for (auto cl_addr: LengthCLRange(entry))
-                    for (unsigned i = 0; i < GROUP_SIZE * CL_EXPAND_FACTOR; i++)
-                        do_writeback((char *)cl_addr + (i * CACHE_LINE_SIZE));
-            } else {
-                for (auto cl_addr: MaskCLRange(get_ptr(entry), get_mask16(entry)))
-                    for (unsigned i = 0; i < CL_EXPAND_FACTOR; i++)
-                        do_writeback((char *)cl_addr + i * CACHE_LINE_SIZE);
-            }
-#endif
+        if (is_length_based(entry)) {
+            char *begin = (char *)get_ptr(entry);
+            writeback_lines(begin, begin + ((uintptr_t)get_length(entry) << GROUP_SHIFT));
+        } else {
+            writeback_mask((char *)get_ptr(entry), get_mask16(entry));
         }
+#endif
+    }
 
+    inline vc_clock_t close_log(Log *&log, bool is_release) {
+        vc_clock_t clk_val = 0;
         // release store in LogManager::produce_tail acts as writeback fence
 #if DELAY_PUBLISH
         if (is_release) {
-             clk_val = log_mgrs[node_id].produce_tail(curr_log, is_release);
-             curr_log = nullptr;
+             clk_val = log_mgrs[node_id].produce_tail(log, is_release);
+             log = nullptr;
         }
 #else
-        clk_val = log_mgrs[node_id].produce_tail(curr_log, is_release);
+        clk_val = log_mgrs[node_id].produce_tail(log, is_release);
 #endif
         STATS(cache_info->produced_count++;)
         LOG_DEBUG("node " << node_id << " produce log " << cache_info->produced_count)
+        return clk_val;
+    }
+
+    vc_clock_t write_to_log(bool is_release) {
+        Log *local_log;
+        Log *&log = open_log(local_log);
+        for(auto entry: dirty_cls) {
+            if (entry)
+                log_entry(log, entry, is_release);
+        }
+        vc_clock_t clk_val = close_log(log, is_release);
         dirty_cls.clear_table();
         return clk_val;
     }
@@ -111,6 +125,8 @@ public:
 #if TIME_STATS
         uint64_t start = __rdtsc();
 #endif
+        // the cache agent may hold the log we need
+        cache_info->post_demand(target, node_id);
         bool done = false;
         bool node_done[NODE_COUNT] = {false};
         while (!done) {
@@ -129,8 +145,10 @@ public:
                     continue;
                 }
 
-                auto &mtx = cache_info->get_log_head_mutex(node_id);
+                auto &mtx = cache_info->get_log_head_mutex(i);
                 if (!mtx.try_lock()) {
+                    // the holder may be invalidating a long range
+                    cache_info->help_invalidate();
                     done = false;
                     continue;
                 }
@@ -164,6 +182,7 @@ public:
 #if TIME_STATS
         uint64_t start = __rdtsc();
 #endif
+        cache_info->post_demand(target, node_id);
        for (unsigned i = 0; i<NODE_COUNT; i++) {
            if (i == node_id)
                continue;
@@ -171,7 +190,8 @@ public:
                continue;
            while (cache_info->get_clock(i) < target[i]) {
                LOG_DEBUG("node " << node_id << " block on acquire, index=" << i << ", target=" << target[i] << ", current=" << curr)
-               sched_yield();
+               if (!cache_info->help_invalidate())
+                   sched_yield();
            }
        }
 #if TIME_STATS
@@ -182,16 +202,16 @@ public:
 
     inline bool thread_release() {
         LOG_DEBUG("thread " << std::this_thread::get_id() << " release at " << this << std::dec << ", thread clock=" <<thread_clock)
-        if (!recent_cl)
+        if (!has_pending)
             return false;
 
 #if EAGER_WRITEBACK
-        uintptr_t recent_addr = recent_cl << VIRTUAL_CL_SHIFT;
-        for (unsigned i = 0; i < CL_EXPAND_FACTOR; i++)
-             do_writeback((char *)recent_addr + i * CACHE_LINE_SIZE);
+        if (recent_cl)
+            writeback_mask((char *)(recent_cl << VIRTUAL_CL_SHIFT), 1);
 #endif
 
         recent_cl = 0;
+        has_pending = false;
 
 #ifdef LOCAL_CL_TABLE_BUFFER
         while (dirty_cls.dump_buffer_to_table())
@@ -209,6 +229,56 @@ public:
         return true;
     }
 
+    // Release only the dirty lines in ranges, the rest of the thread's dirty
+    // lines stay pending until its next release. Returns whether anything
+    // was released.
+    inline bool thread_release_scoped(const DataRange *ranges, size_t count) {
+#if !LOCAL_CL_TABLE
+        // stores are already logged as they happen
+        (void)ranges;
+        (void)count;
+        return thread_release();
+#else
+        if (!has_pending)
+            return false;
+
+#if EAGER_WRITEBACK
+        if (recent_cl)
+            writeback_mask((char *)(recent_cl << VIRTUAL_CL_SHIFT), 1);
+#endif
+        // the entry of the recent line may be taken below, so its next store
+        // must not be skipped by INLINE_CACHING
+        recent_cl = 0;
+
+#ifdef LOCAL_CL_TABLE_BUFFER
+        while (dirty_cls.dump_buffer_to_table())
+            write_to_log(false);
+#endif
+
+        // the log is only opened once an entry overlaps, so that no empty
+        // release log is produced
+        Log *local_log;
+        Log **log = nullptr;
+        dirty_cls.take_overlapping(ranges, count, [&](cl_group_t entry) {
+            if (!log)
+                log = &open_log(local_log);
+            log_entry(*log, entry, true);
+        });
+        if (!log)
+            return false;
+        vc_clock_t clk_val = close_log(*log, true);
+        // the remaining lines are published by the next release
+        has_pending = !dirty_cls.is_empty();
+        thread_clock.assign(node_id, clk_val);
+        return true;
+#endif
+    }
+
+    // have cache agents prioritize logs up to clock
+    inline void post_demand(const VectorClock &clock) {
+        cache_info->post_demand(clock, node_id);
+    }
+
     inline void thread_acquire(const VectorClock &clock) {
         LOG_DEBUG("thread " << std::this_thread::get_id() << " acquire at " << this << std::dec << ", loc clock=" <<clock)
 #if CONSUME_HELPING
@@ -219,6 +289,11 @@ public:
         thread_clock.merge(clock);
     }
 
+    // acquire a clock released on this node, which has already consumed the logs it covers
+    inline void thread_acquire_local(const VectorClock &clock) {
+        thread_clock.merge(clock);
+    }
+
     inline void log_store(char *addr) {
         uintptr_t cl = (uintptr_t)addr >> VIRTUAL_CL_SHIFT;
 #if INLINE_CACHING
@@ -226,13 +301,11 @@ public:
             return;
 #endif
 #if EAGER_WRITEBACK
-       if (recent_cl) {
-            uintptr_t recent_addr = recent_cl << VIRTUAL_CL_SHIFT;
-            for (unsigned i = 0; i < CL_EXPAND_FACTOR; i++)
-                 do_writeback((char *)recent_addr + i * CACHE_LINE_SIZE);
-        }
+       if (recent_cl)
+            writeback_mask((char *)(recent_cl << VIRTUAL_CL_SHIFT), 1);
 #endif
         recent_cl = cl;
+        has_pending = true;
 
 #if !LOCAL_CL_TABLE && !EAGER_WRITEBACK
         do_writeback(addr);
@@ -257,6 +330,7 @@ public:
         uintptr_t begin_addr = (uintptr_t)begin >> VIRTUAL_CL_SHIFT;
         uintptr_t end_addr = (uintptr_t)end >> VIRTUAL_CL_SHIFT;
         recent_cl = end_addr;
+        has_pending = true;
 #if !LOCAL_CL_TABLE
         for (uintptr_t cl = begin_addr; cl < end_addr; cl++)
             write_cl_to_log(cl);
@@ -274,11 +348,21 @@ public:
 extern CacheInfo cache_info;
 
 inline bool check_range_invalidate(char *begin, char *end) {
-        return cache_info.inv_cls.invalidate_range_if_dirty((uintptr_t)begin, (uintptr_t)end);
+        bool hit = cache_info.inv_cls.invalidate_range_if_dirty((uintptr_t)begin, (uintptr_t)end);
+#if LAZY_INVALIDATE
+        if (hit)
+            cache_info.sample_lazy_hit((uintptr_t)begin);
+#endif
+        return hit;
 }
 
 inline bool check_invalidate(char *addr) {
-        return cache_info.inv_cls.invalidate_if_dirty((uintptr_t)addr);
+        bool hit = cache_info.inv_cls.invalidate_if_dirty((uintptr_t)addr);
+#if LAZY_INVALIDATE
+        if (hit)
+            cache_info.sample_lazy_hit((uintptr_t)addr);
+#endif
+        return hit;
 }
 
 } // RACoherence
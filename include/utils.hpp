@@ -2,6 +2,7 @@
 #define _UTIL_H_
 
 #include <array>
+#include <mutex>
 #include <shared_mutex>
 
 #include "config.hpp" 
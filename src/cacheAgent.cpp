@@ -1,56 +1,156 @@
 #include "cacheAgent.hpp"
 #include "flushUtils.hpp"
+#include "futex.hpp"
 
 namespace RACoherence {
 
+bool CacheAgent::consume(unsigned i, bool &more) {
+    more = false;
+    if (!log_mgrs[i].is_subscribed(node_id))
+        return false;
+
+#if LOCKED_CONSUME
+    auto &mtx = cache_info.get_log_head_mutex(i);
+    if (!mtx.try_lock()) {
+        more = true;
+        return false;
+    }
+#endif
+    bool consumed = false;
+    vc_clock_t clk = 0;
+    more = true;
+    // logs that threads are blocked on are consumed past the batch limit,
+    // and the clock is published as soon as the demand is met
+    vc_clock_t demand = cache_info.get_demand(i);
+    for (unsigned j=0; j<LOG_MAX_BATCH || demand; j++) {
+        const LogManager::PubEntry* entry = log_mgrs[i].take_head(node_id);
+        if (!entry) {
+            more = false;
+            break;
+        }
+        Log* log = entry->log.load(std::memory_order_relaxed);
+
+        if (entry->is_rel)
+            clk = entry->idx.load(std::memory_order_relaxed);
+        consumed = true;
+        cache_info.process_log(*log);
+
+        STATS(cache_info.consumed_count[i]++)
+        LOG_DEBUG("node " << node_id << " agent " << agent_id << " consume log " << cache_info.consumed_count[i] << " from " << i << " clock=" << cache_info.get_clock(i))
+        log_mgrs[i].consume_head(node_id);
+        if (demand && clk >= demand)
+            break;
+    }
+    if (clk) {
+        // mutex unlock takes care of invalidate fence for LOCKED_CONSUME
+#if (EAGER_INVALIDATE || HYBRID_INVALIDATE) && !LOCKED_CONSUME
+        invalidate_fence();
+#endif
+        cache_info.update_clock(i, clk);
+    }
+#if LOCKED_CONSUME
+    mtx.unlock();
+#endif
+    return consumed;
+}
+
+bool CacheAgent::consume_nodes(uint64_t bits) {
+    bool busy = false;
+    while (bits) {
+        unsigned i = __builtin_ctzll(bits);
+        bits &= bits - 1;
+        uint64_t bit = 1ull << i;
+        bool more = false;
+        if (i != node_id && i < NODE_COUNT)
+            busy |= consume(i, more);
+        if (!more)
+            pending &= ~bit;
+        else if (!(own_mask & bit)) {
+            // give logs left by a stolen batch back to their owner
+            pending &= ~bit;
+            doorbell.pending.fetch_or(bit);
+        }
+    }
+    return busy;
+}
+
+bool CacheAgent::consume_pending(uint64_t mask) {
+    // a bit is claimed before its log is read, so a log published
+    // after the log is found empty rings the doorbell again
+    pending |= doorbell.claim(mask);
+    // serve nodes that threads are blocked on first
+    uint64_t demanded = pending & mask & cache_info.demanded_nodes();
+    bool busy = consume_nodes(demanded);
+    // then the rest, starting from a rotating node for fairness
+    uint64_t rest = pending & mask & ~demanded;
+    uint64_t low = (1ull << next_start) - 1;
+    busy |= consume_nodes(rest & ~low);
+    busy |= consume_nodes(rest & low);
+    next_start = (next_start + 1) % NODE_COUNT;
+    return busy;
+}
+
+void CacheAgent::idle_wait(unsigned idle_rounds) {
+    if (idle_rounds < AGENT_SPIN_ROUNDS) {
+        cpu_pause();
+        return;
+    }
+    uint32_t seq = doorbell.seq.load();
+    // announce waiting before checking the doorbell one last time,
+    // producers check for waiting agents after ringing it
+    doorbell.waiting.fetch_add(1);
+    if (!has_logs() && !complete.load()) {
+        bool woken = false;
+        if (has_waitpkg()) {
+            // producers ring the doorbell on the monitored line
+            for (unsigned i = 0; i < AGENT_UMWAIT_ROUNDS && !woken; i++) {
+                cpu_umonitor(&doorbell);
+                if (!has_logs() && doorbell.seq.load() == seq)
+                    cpu_umwait(read_tsc() + AGENT_UMWAIT_CYCLES);
+                woken = has_logs() || doorbell.seq.load() != seq;
+            }
+        }
+        if (!woken) {
+            doorbell.sleeping.fetch_add(1);
+            // returns right away if seq changed since it was read
+            futex_wait(&doorbell.seq, seq);
+            doorbell.sleeping.fetch_sub(1);
+        }
+    }
+    doorbell.waiting.fetch_sub(1);
+}
+
 void CacheAgent::run() {
-    int idle_rounds = 0;
+    unsigned idle_rounds = 0;
     while(!complete.load()) {
-        for (unsigned i=0; i<NODE_COUNT; i++) {
-            if (i == node_id)
-                continue;
-            if (!log_mgrs[i].is_subscribed(node_id))
-                continue;
-
-#if CONSUME_HELPING || CONSUME_HELPING_IN_LOCK
-            auto &mtx = cache_info.get_log_head_mutex(node_id);
-            if (!mtx.try_lock())
-                continue;
+        // shards of a long range another agent is invalidating
+        bool busy = cache_info.help_invalidate();
+        busy |= consume_pending(own_mask);
+#if CACHE_AGENT_COUNT > 1
+        // own logs are drained, help agents that fall behind on theirs
+        if (!busy)
+            busy = consume_pending(~own_mask);
 #endif
-            vc_clock_t clk = 0;
-            for (unsigned j=0; j<LOG_MAX_BATCH; j++) {
-                const LogManager::PubEntry* entry = log_mgrs[i].take_head(node_id);
-                if (!entry) {
-                    if (idle_rounds >= NODE_COUNT -1) {
-                        cpu_pause();
-                    } else
-                        idle_rounds ++;
-                    break;
-                }
-                Log* log = entry->log.load(std::memory_order_relaxed);
-
-                if (entry->is_rel)
-                    clk = entry->idx.load(std::memory_order_relaxed);
-                idle_rounds = 0;
-                cache_info.process_log(*log);
-
-                STATS(cache_info.consumed_count[i]++)
-                LOG_DEBUG("node " << node_id << " consume log " << cache_info.consumed_count[i] << " from " << i << " clock=" << cache_info.get_clock(i))
-                log_mgrs[i].consume_head(node_id);
-            }
-            if (clk) {
-                // mutex unlock takes care of invalidate fence for CONSUME_HELPING
-#if EAGER_INVALIDATE && ! (CONSUME_HELPING || CONSUME_HELPING_IN_LOCK)
-                invalidate_fence();
+        if (agent_id == 0) {
+#if LAZY_INVALIDATE && BACKGROUND_INVALIDATE
+            // no log had new entries
+            if (!busy)
+                busy = cache_info.drain_tracker(BACKGROUND_INVALIDATE_BUDGET);
 #endif
-                cache_info.update_clock(i, clk);
-            }
-#if CONSUME_HELPING || CONSUME_HELPING_IN_LOCK
-            mtx.unlock();
+#if LAZY_INVALIDATE
+            // recycle tracker leaves emptied by user threads
+            cache_info.inv_cls.reclaim();
 #endif
         }
+        if (busy) {
+            idle_rounds = 0;
+        } else {
+            idle_wait(idle_rounds);
+            if (idle_rounds < AGENT_SPIN_ROUNDS)
+                idle_rounds++;
+        }
     }
-    LOG_INFO("node " << node_id << " cache agent done")
+    LOG_INFO("node " << node_id << " cache agent " << agent_id << " done")
 }
 
 } // RACoherence
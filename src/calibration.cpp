@@ -0,0 +1,165 @@
+#include <algorithm>
+#include <chrono>
+#include <cfloat>
+#include <new>
+#include <numa.h>
+#include <unistd.h>
+
+#include "calibration.hpp"
+#include "clGroup.hpp"
+#include "clTracker.hpp"
+#include "flushUtils.hpp"
+#include "logger.hpp"
+
+namespace RACoherence {
+
+FlushCosts flush_costs;
+FlushPolicy flush_policy;
+
+namespace {
+
+// larger than private caches, so lines are flushed from every level
+constexpr size_t CALIBRATION_BUF_SIZE = 1ull << 22;
+constexpr size_t CALIBRATION_LINES = CALIBRATION_BUF_SIZE / CACHE_LINE_SIZE;
+constexpr unsigned CALIBRATION_ROUNDS = 3;
+constexpr unsigned FENCE_ITERS = 4096;
+
+void touch_lines(char *buf, bool dirty) {
+    for (size_t i = 0; i < CALIBRATION_BUF_SIZE; i += CACHE_LINE_SIZE) {
+        if (dirty)
+            ((volatile char *)buf)[i] = (char)i;
+        else
+            (void)((volatile char *)buf)[i];
+    }
+    __asm__ volatile("mfence":::"memory");
+}
+
+// per-line cost of flushing the buffer, dirty lines as on writeback and clean ones as on invalidation
+template<int Inst>
+double line_cost(char *buf, bool dirty) {
+    double best = DBL_MAX;
+    for (unsigned r = 0; r < CALIBRATION_ROUNDS; r++) {
+        touch_lines(buf, dirty);
+        unsigned long start = read_tsc();
+        for (size_t i = 0; i < CALIBRATION_BUF_SIZE; i += CACHE_LINE_SIZE)
+            flush_line<Inst>(buf + i);
+        __asm__ volatile("mfence":::"memory");
+        best = std::min(best, (double)(read_tsc() - start) / CALIBRATION_LINES);
+    }
+    return best;
+}
+
+double mfence_cost() {
+    unsigned long start = read_tsc();
+    for (unsigned i = 0; i < FENCE_ITERS; i++)
+        __asm__ volatile("mfence":::"memory");
+    return (double)(read_tsc() - start) / FENCE_ITERS;
+}
+
+double sfence_cost() {
+    unsigned long start = read_tsc();
+    for (unsigned i = 0; i < FENCE_ITERS; i++)
+        __asm__ volatile("sfence":::"memory");
+    return (double)(read_tsc() - start) / FENCE_ITERS;
+}
+
+double measure_tsc_per_ns() {
+    using namespace std::chrono;
+    auto start = steady_clock::now();
+    unsigned long tsc_start = read_tsc();
+    while (steady_clock::now() - start < milliseconds(10))
+        cpu_pause();
+    unsigned long tsc_end = read_tsc();
+    auto ns = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+    return (double)(tsc_end - tsc_start) / ns;
+}
+
+double wbinvd_cost(char *buf) {
+#if NO_FLUSH
+    (void)buf;
+    return 0;
+#else
+    if (access(WBINVD_PATH, R_OK))
+        return 0;
+    double best = DBL_MAX;
+    for (unsigned r = 0; r < CALIBRATION_ROUNDS; r++) {
+        touch_lines(buf, true);
+        unsigned long start = read_tsc();
+        wbinvd();
+        best = std::min(best, (double)(read_tsc() - start));
+    }
+    return best;
+#endif
+}
+
+// lines is negative if wbinvd costs less than the fence alone
+size_t lines_to_threshold(double lines, size_t lines_per_unit) {
+    double units = std::max(0.0, lines / lines_per_unit);
+    if (units >= (double)SIZE_MAX)
+        return SIZE_MAX;
+    return std::max<size_t>(1, units);
+}
+
+} // namespace
+
+void apply_cost_model(const FlushCosts &costs) {
+    if (costs.tsc_per_ns)
+        write_latency_cycles = WRITE_LATENCY_IN_NS * costs.tsc_per_ns;
+#if !NO_FLUSH
+    double invalidate = invalidate_inst == CLFLUSH ? costs.clflush : costs.clflushopt;
+    double writeback = writeback_inst == CLWB ? costs.clwb :
+        writeback_inst == CLFLUSHOPT ? costs.clflushopt : costs.clflush;
+    if (!costs.wbinvd) {
+        // bulk flushes are not available
+        disable_bulk_flush();
+        return;
+    }
+    if (!invalidate || !writeback)
+        return;
+    // flushing line by line costs one flush per line and a fence
+    double invalidate_lines = (costs.wbinvd - costs.mfence) / invalidate;
+    double writeback_lines = (costs.wbinvd - costs.sfence) / writeback;
+    flush_policy.wbinvd_groups = lines_to_threshold(invalidate_lines, cl_group::GROUP_SIZE * CL_EXPAND_FACTOR);
+    flush_policy.tracker_wbinvd_leaves = lines_to_threshold(invalidate_lines, LEAF_ENTRIES * CL_EXPAND_FACTOR);
+    flush_policy.wbinvd_writeback_bytes = lines_to_threshold(writeback_lines, 1) * CACHE_LINE_SIZE;
+#endif
+}
+
+void disable_bulk_flush() {
+    flush_policy.wbinvd_groups = SIZE_MAX;
+    flush_policy.tracker_wbinvd_leaves = SIZE_MAX;
+    flush_policy.wbinvd_writeback_bytes = SIZE_MAX;
+}
+
+void calibrate_flush_costs() {
+    FlushCosts costs;
+    costs.tsc_per_ns = measure_tsc_per_ns();
+#if !NO_FLUSH
+    // measured on the memory that NHC CXL memory is allocated from
+    int numa_id = CXL_NUMA_MODE ? CXL_NUMA_NODE_ID : LOCAL_NUMA_NODE_ID;
+    if (numa_id > numa_max_node())
+        numa_id = LOCAL_NUMA_NODE_ID;
+    char *buf = (char *)numa_alloc_onnode(CALIBRATION_BUF_SIZE, numa_id);
+    if (!buf) {
+        std::bad_alloc exception;
+        throw exception;
+    }
+    costs.clflush = line_cost<CLFLUSH>(buf, false);
+    if (has_clflushopt())
+        costs.clflushopt = line_cost<CLFLUSHOPT>(buf, false);
+    if (has_clwb())
+        costs.clwb = line_cost<CLWB>(buf, true);
+    costs.mfence = mfence_cost();
+    costs.sfence = sfence_cost();
+    costs.wbinvd = wbinvd_cost(buf);
+    numa_free(buf, CALIBRATION_BUF_SIZE);
+#endif
+    flush_costs = costs;
+    apply_cost_model(costs);
+    LOG_INFO("calibration: tsc/ns=" << costs.tsc_per_ns << " clflush=" << costs.clflush << " clflushopt=" << costs.clflushopt
+        << " clwb=" << costs.clwb << " mfence=" << costs.mfence << " sfence=" << costs.sfence << " wbinvd=" << costs.wbinvd)
+    LOG_INFO("calibration: wbinvd from " << flush_policy.wbinvd_groups << " groups, " << flush_policy.tracker_wbinvd_leaves
+        << " tracker leaves, " << flush_policy.wbinvd_writeback_bytes << " writeback bytes")
+}
+
+} // RACoherence
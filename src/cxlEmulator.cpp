@@ -0,0 +1,31 @@
+#include <cstdlib>
+#include <iostream>
+
+#include "cxlEmulator.hpp"
+#include "logger.hpp"
+
+namespace RACoherence {
+
+#if CXL_EMULATION
+static long env_or(const char *name, long def) {
+    const char *val = std::getenv(name);
+    return val ? std::atol(val) : def;
+}
+
+void cxl_emu_init(double tsc_per_ns) {
+    long read_ns = env_or("RAC_EMU_READ_NS", CXL_EMU_READ_LATENCY_NS);
+    long writeback_ns = env_or("RAC_EMU_WRITEBACK_NS", CXL_EMU_WRITEBACK_LATENCY_NS);
+    long bandwidth_mbps = env_or("RAC_EMU_BANDWIDTH_MBPS", CXL_EMU_BANDWIDTH_MBPS);
+    cxl_emu.read_cycles = read_ns * tsc_per_ns;
+    cxl_emu.writeback_cycles = writeback_ns * tsc_per_ns;
+    // MB/s is bytes per us
+    cxl_emu.cycles_per_byte = bandwidth_mbps > 0 ? tsc_per_ns * 1000 / bandwidth_mbps : 0;
+    LOG_INFO("cxl emulation: read " << read_ns << "ns, writeback " << writeback_ns << "ns, bandwidth " << bandwidth_mbps << "MB/s")
+}
+
+void cxl_emu_dump_stats() {
+    LOG_STATS("cxl emulation: " << cxl_emu.read_misses.load() << " read misses, " << cxl_emu.writebacks.load() << " lines written back");
+}
+#endif
+
+} // RACoherence
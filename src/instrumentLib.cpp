@@ -65,7 +65,7 @@ void * memcpy(void * dst, const void * src, size_t n) {
         do_range_invalidate((char *)src, n);
     if (is_in_cxl_nhc_dst)
         invalidate_boundaries(dst_begin, dst_end); 
-#elif !EAGER_INVALIDATE
+#elif LAZY_INVALIDATE
     char *src_begin = (char *)src;
     char *src_end = src_begin + n;
     if (is_in_cxl_nhc_src)
@@ -73,17 +73,22 @@ void * memcpy(void * dst, const void * src, size_t n) {
     if (is_in_cxl_nhc_dst)
         invalidate_boundaries(dst_begin, dst_end); 
 #endif
+    if (is_in_cxl_nhc_src)
+        nhc_pre_access(src, n);
+    if (is_in_cxl_nhc_dst)
+        nhc_pre_access(dst, n);
     if (((uintptr_t)memcpy_real) < 2) {
-        for(unsigned i=0;i<n;i++) {
+        for(size_t i=0;i<n;i++) {
             ((volatile char *)dst)[i] = ((char *)src)[i];
         }
         ret = dst;
     } else
         ret = memcpy_real(dst, src, n);
     if (is_in_cxl_nhc_dst) {
+        nhc_post_store(dst, n);
 #if PROTOCOL_OFF
         do_range_writeback((char *)dst, n);
-#elif EAGER_WRITE_BACK
+#elif EAGER_WRITEBACK
         do_range_writeback((char *)dst, n);
         thread_ops->log_range_store(dst_begin, dst_end);
 #else
@@ -104,7 +109,7 @@ void * memmove(void *dst, const void *src, size_t n) {
         do_range_invalidate((char *)src, n);
     if (is_in_cxl_nhc_dst)
         invalidate_boundaries(dst_begin, dst_end); 
-#elif !EAGER_INVALIDATE
+#elif LAZY_INVALIDATE
     char *src_begin = (char *)src;
     char *src_end = src_begin + n;
     if (is_in_cxl_nhc_src)
@@ -112,9 +117,13 @@ void * memmove(void *dst, const void *src, size_t n) {
     if (is_in_cxl_nhc_dst)
         invalidate_boundaries(dst_begin, dst_end); 
 #endif
+    if (is_in_cxl_nhc_src)
+        nhc_pre_access(src, n);
+    if (is_in_cxl_nhc_dst)
+        nhc_pre_access(dst, n);
     if (((uintptr_t)memmove_real) < 2) {
         if (((uintptr_t)dst) < ((uintptr_t)src))
-            for(unsigned i=0;i<n;i++) {
+            for(size_t i=0;i<n;i++) {
                 ((volatile char *)dst)[i] = ((char *)src)[i];
             }
         else
@@ -126,9 +135,10 @@ void * memmove(void *dst, const void *src, size_t n) {
     } else
         ret = memmove_real(dst, src, n);
     if (is_in_cxl_nhc_dst) {
+        nhc_post_store(dst, n);
 #if PROTOCOL_OFF
         do_range_writeback((char *)dst, n);
-#elif EAGER_WRITE_BACK
+#elif EAGER_WRITEBACK
         do_range_writeback((char *)dst, n);
         thread_ops->log_range_store(dst_begin, dst_end);
 #else
@@ -146,21 +156,24 @@ void * memset(void *dst, int c, size_t n) {
 #if PROTOCOL_OFF
     if (is_in_cxl_nhc)
         invalidate_boundaries(dst_begin, dst_end);
-#elif !EAGER_INVALIDAE
+#elif LAZY_INVALIDATE
     if(is_in_cxl_nhc)
         invalidate_boundaries(dst_begin, dst_end);
 #endif
+    if (is_in_cxl_nhc)
+        nhc_pre_access(dst, n);
     if (((uintptr_t)memset_real) < 2) {
-        for(unsigned i=0;i<n;i++) {
+        for(size_t i=0;i<n;i++) {
             ((volatile char *)dst)[i] = (char) c;
         }
         ret = dst;
     } else
         ret = memset_real(dst, c, n);
     if (is_in_cxl_nhc) {
+        nhc_post_store(dst, n);
 #if PROTOCOL_OFF
         do_range_writeback((char *)dst, n);
-#elif EAGER_WRITE_BACK
+#elif EAGER_WRITEBACK
         do_range_writeback((char *)dst, n);
         thread_ops->log_range_store(dst_begin, dst_end);
 #else
@@ -178,10 +191,12 @@ void bzero(void *dst, size_t n) {
 #if PROTOCOL_OFF
     if (is_in_cxl_nhc)
         invalidate_boundaries(dst_begin, dst_end);
-#elif !EAGER_INVALIDATE
+#elif LAZY_INVALIDATE
     if(is_in_cxl_nhc)
         invalidate_boundaries(dst_begin, dst_end);
 #endif
+    if (is_in_cxl_nhc)
+        nhc_pre_access(dst, n);
     if (((uintptr_t)bzero_real) < 2) {
         for(size_t s=0;s<n;s++) {
             ((volatile char *)dst)[s] = 0;
@@ -189,9 +204,10 @@ void bzero(void *dst, size_t n) {
     } else
         bzero_real(dst, n);
     if (is_in_cxl_nhc) {
+        nhc_post_store(dst, n);
 #if PROTOCOL_OFF
         do_range_writeback((char *)dst, n);
-#elif EAGER_WRITE_BACK
+#elif EAGER_WRITEBACK
         do_range_writeback((char *)dst, n);
         thread_ops->log_range_store(dst_begin, dst_end);
 #else
@@ -206,7 +222,7 @@ char * strcpy(char *dst, const char *src) {
     bool is_in_cxl_nhc_dst = in_cxl_nhc_mem((char *)dst);
     size_t n = 0;
     // we cannot invalidate ahead-of-time because the length is unknown
-#if PROTOCOL_OFF || !EAGER_INVALIDATE
+#if PROTOCOL_OFF || LAZY_INVALIDATE || NC_SIMULATION
     bool need_invalidate = true;
 #else
     bool need_invalidate = false;
@@ -216,39 +232,48 @@ char * strcpy(char *dst, const char *src) {
 #if PROTOCOL_OFF
             if (is_in_cxl_nhc_src)
                 do_invalidate((char *)&src[n]);
-#elif !EAGER_INVALIDATE
+#elif LAZY_INVALIDATE
             if (is_in_cxl_nhc_src)
                 check_invalidate((char *)&src[n]);
 #endif
+            if (is_in_cxl_nhc_src)
+                nhc_pre_access(&src[n], 1);
             bool end = false;
-            for(;((uintptr_t)&src[n] & CACHE_LINE_MASK); n++) {
-                if (src[n] == '\0') {
-                    n++;
+            // scan to the end of the line
+            do {
+                if (src[n++] == '\0') {
                     end = true;
                     break;
                 }
-            }
+            } while ((uintptr_t)&src[n] & CACHE_LINE_MASK);
             if (end)
                 break;
         }
 #if PROTOCOL_OFF
         if (is_in_cxl_nhc_dst)
             invalidate_boundaries(dst, (char *)&dst[n]);
-#elif !EAGER_INVALIDATE
+#elif LAZY_INVALIDATE
         if (is_in_cxl_nhc_dst)
             invalidate_boundaries(dst, (char *)&dst[n]);
 #endif
-        for (int i; i < n; i++)
+        if (is_in_cxl_nhc_dst)
+            nhc_pre_access(dst, n);
+        for (size_t i = 0; i < n; i++)
             ((volatile char *)dst)[i] = ((char *)src)[i];
         ret = dst;
     } else {
         ret = strcpy_real(dst, src);
         while (src[n]!= '\0') n++;
+        if (is_in_cxl_nhc_src)
+            nhc_pre_access(src, n);
+        if (is_in_cxl_nhc_dst)
+            nhc_pre_access(dst, n);
     }
     if (is_in_cxl_nhc_dst) {
+        nhc_post_store(dst, n);
 #if PROTOCOL_OFF
         do_range_writeback((char *)dst, n);
-#elif EAGER_WRITE_BACK
+#elif EAGER_WRITEBACK
         do_range_writeback((char *)dst, n);
         thread_ops->log_range_store(dst, (char *)dst+n);
 #else
@@ -266,19 +291,23 @@ ssize_t read(int fd, void* buf, size_t count) {
 #if PROTOCOL_OFF
     if (is_in_cxl_nhc)
         invalidate_boundaries(buf_begin, buf_end);
-#elif !EAGER_INVALIDATE
+#elif LAZY_INVALIDATE
     if(is_in_cxl_nhc)
         invalidate_boundaries(buf_begin, buf_end);
 #endif
+    if (is_in_cxl_nhc)
+        nhc_pre_access(buf, count);
     if (((uintptr_t)read_real) < 2) {
         LOG_ERROR("unable to find read() with dlsym") 
         exit(EXIT_FAILURE); 
     } else
         ret = read_real(fd, buf, count);
     if (is_in_cxl_nhc) {
+        // only the bytes read were stored
+        nhc_post_store(buf, ret > 0 ? ret : 0);
 #if PROTOCOL_OFF
         do_range_writeback((char *)buf, count);
-#elif EAGER_WRITE_BACK
+#elif EAGER_WRITEBACK
         do_range_writeback((char *)buf, count);
         thread_ops->log_range_store(buf_begin, buf_end);
 #else
@@ -0,0 +1,189 @@
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <sys/mman.h>
+
+#include "flushUtils.hpp"
+#include "logger.hpp"
+#include "ncSim.hpp"
+
+namespace RACoherence {
+
+#if NC_SIMULATION
+namespace {
+
+constexpr uint8_t LINE_VALID = 1;
+constexpr uint8_t LINE_DIRTY = 2;
+constexpr uint8_t LINE_FILLING = 4;
+
+char *cache_base;
+char *mem_base;
+size_t sim_range;
+// per-line state, shared by the threads of the process like a hardware cache
+std::atomic<uint8_t> *line_state;
+
+std::atomic<uint64_t> hits{0};
+std::atomic<uint64_t> misses{0};
+std::atomic<uint64_t> stale_reads{0};
+std::atomic<uint64_t> writebacks{0};
+std::atomic<uint64_t> invalidations{0};
+
+// lines of [begin, end) within the simulated range, returns false if none
+bool line_range(const void *begin, const void *end, size_t &first, size_t &last) {
+    uintptr_t b = std::max((uintptr_t)begin, (uintptr_t)cache_base);
+    uintptr_t e = std::min((uintptr_t)end, (uintptr_t)cache_base + sim_range);
+    if (!cache_base || b >= e)
+        return false;
+    first = (b - (uintptr_t)cache_base) >> CACHE_LINE_SHIFT;
+    last = (e - (uintptr_t)cache_base + CACHE_LINE_MASK) >> CACHE_LINE_SHIFT;
+    return true;
+}
+
+inline char *cache_line(size_t i) {
+    return cache_base + (i << CACHE_LINE_SHIFT);
+}
+
+inline char *mem_line(size_t i) {
+    return mem_base + (i << CACHE_LINE_SHIFT);
+}
+
+// wait for a concurrent fill of line i and return its state
+inline uint8_t settled_state(size_t i) {
+    uint8_t s = line_state[i].load(std::memory_order_acquire);
+    while (s & LINE_FILLING) {
+        cpu_pause();
+        s = line_state[i].load(std::memory_order_acquire);
+    }
+    return s;
+}
+
+void fill(size_t i) {
+    uint8_t s = line_state[i].load(std::memory_order_acquire);
+    while (true) {
+        if (s & LINE_VALID) {
+            hits.fetch_add(1, std::memory_order_relaxed);
+            if (!(s & LINE_DIRTY) && std::memcmp(cache_line(i), mem_line(i), CACHE_LINE_SIZE))
+                stale_reads.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        if (s & LINE_FILLING) {
+            // filled by another thread, which may also have been invalidated since
+            s = settled_state(i);
+            continue;
+        }
+        if (line_state[i].compare_exchange_weak(s, LINE_FILLING, std::memory_order_acquire)) {
+            misses.fetch_add(1, std::memory_order_relaxed);
+            std::memcpy(cache_line(i), mem_line(i), CACHE_LINE_SIZE);
+            line_state[i].store(LINE_VALID, std::memory_order_release);
+            return;
+        }
+    }
+}
+
+// mark line i dirty after a store to [b, e). If the line was invalidated
+// since it was filled, the store already wrote the private copy, so the
+// rest of the line is fetched again as hardware would before the store.
+void store(size_t i, uintptr_t b, uintptr_t e) {
+    uint8_t s = line_state[i].load(std::memory_order_acquire);
+    while (true) {
+        if (s & LINE_FILLING) {
+            s = settled_state(i);
+            continue;
+        }
+        if (s & LINE_VALID) {
+            if ((s & LINE_DIRTY) || line_state[i].compare_exchange_weak(s, s | LINE_DIRTY, std::memory_order_release))
+                return;
+            continue;
+        }
+        if (line_state[i].compare_exchange_weak(s, LINE_FILLING, std::memory_order_acquire)) {
+            misses.fetch_add(1, std::memory_order_relaxed);
+            uintptr_t line = (uintptr_t)cache_line(i);
+            uintptr_t sb = std::max(b, line) - line;
+            uintptr_t se = std::min(e, line + CACHE_LINE_SIZE) - line;
+            std::memcpy(cache_line(i), mem_line(i), sb);
+            std::memcpy(cache_line(i) + se, mem_line(i) + se, CACHE_LINE_SIZE - se);
+            line_state[i].store(LINE_VALID | LINE_DIRTY, std::memory_order_release);
+            return;
+        }
+    }
+}
+
+void write_back(size_t i, bool evict) {
+    uint8_t s = settled_state(i);
+    if (s & LINE_DIRTY) {
+        std::memcpy(mem_line(i), cache_line(i), CACHE_LINE_SIZE);
+        writebacks.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (evict)
+        line_state[i].store(0, std::memory_order_release);
+    else if (s & LINE_DIRTY)
+        line_state[i].fetch_and(~LINE_DIRTY, std::memory_order_release);
+}
+
+} // namespace
+
+void nc_sim_init(char *cache, char *mem, size_t range) {
+    size_t lines = range >> CACHE_LINE_SHIFT;
+    // zero-filled on demand, all lines start out invalid
+    void *state = mmap(nullptr, lines, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (state == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    line_state = (std::atomic<uint8_t> *)state;
+    mem_base = mem;
+    sim_range = range;
+    cache_base = cache;
+}
+
+void nc_sim_access(const void *addr, size_t len) {
+    size_t first, last;
+    if (!line_range(addr, (const char *)addr + len, first, last))
+        return;
+    for (size_t i = first; i < last; i++)
+        fill(i);
+}
+
+void nc_sim_stored(const void *addr, size_t len) {
+    size_t first, last;
+    if (!line_range(addr, (const char *)addr + len, first, last))
+        return;
+    for (size_t i = first; i < last; i++)
+        store(i, (uintptr_t)addr, (uintptr_t)addr + len);
+}
+
+void nc_sim_writeback(const void *begin, const void *end, bool evict) {
+    size_t first, last;
+    if (!line_range(begin, end, first, last))
+        return;
+    for (size_t i = first; i < last; i++)
+        write_back(i, evict);
+}
+
+void nc_sim_invalidate(const void *begin, const void *end) {
+    size_t first, last;
+    if (!line_range(begin, end, first, last))
+        return;
+    for (size_t i = first; i < last; i++) {
+        invalidations.fetch_add(1, std::memory_order_relaxed);
+        write_back(i, true);
+    }
+}
+
+void nc_sim_invalidate_all() {
+    if (!cache_base)
+        return;
+    for (size_t i = 0; i < sim_range >> CACHE_LINE_SHIFT; i++) {
+        if (line_state[i].load(std::memory_order_relaxed))
+            write_back(i, true);
+    }
+}
+
+void nc_sim_dump_stats() {
+    LOG_STATS("nc simulation: " << hits.load() << " hits, " << misses.load() << " misses, " << stale_reads.load() << " stale reads, "
+        << writebacks.load() << " lines written back, " << invalidations.load() << " lines invalidated");
+}
+#endif
+
+} // RACoherence
@@ -8,6 +8,8 @@
 #include <x86intrin.h>
 
 #include "cacheAgent.hpp"
+#include "calibration.hpp"
+#include "cxlEmulator.hpp"
 #include "globalMeta.hpp"
 #include "instrumentLib.hpp"
 #include "logger.hpp"
@@ -36,7 +38,7 @@ size_t cxl_nhc_range;
 char *cxl_hc_buf;
 size_t cxl_hc_range;
 CacheInfo cache_info;
-pthread_t cache_agent;
+pthread_t cache_agents[CACHE_AGENT_COUNT];
 GlobalMeta *meta;
 #if TIME_STATS
 std::atomic<uint64_t> thread_cycles; 
@@ -98,6 +100,14 @@ int rac_thread_join(unsigned /*nid*/, pthread_t thread, void **thread_ret) {
     return ret;
 }
 
+void rac_release_fence() {
+#if PROTOCOL_OFF
+    writeback_fence();
+#else
+    thread_ops->thread_release();
+#endif
+}
+
 unsigned rac_get_node_id() {
     return thread_ops->get_node_id();
 }
@@ -133,6 +143,7 @@ bool rac_is_subscribed_to_node(unsigned target) {
 
 struct CacheAgentArg {
     unsigned node_id;
+    unsigned agent_id;
     unsigned cpu_id;
 };
 
@@ -142,7 +153,7 @@ void *run_cache_agent(void *arg) {
     pin_to_core(carg->cpu_id);
 #endif
     unsigned nid = carg->node_id;
-    CacheAgent(cache_info, &meta->log_mgrs[0], nid).run();
+    CacheAgent(cache_info, &meta->log_mgrs[0], meta->doorbells[nid], nid, carg->agent_id).run();
     return arg;
 }
 
@@ -174,18 +185,32 @@ void alloc_cxl_memory() {
         perror("mmap");
         exit(EXIT_FAILURE);
     }
+#if NC_SIMULATION
+    // the process caches NHC memory in private memory at CXL_NHC_START,
+    // the shared segment behind it is mapped elsewhere
+    char *nhc_mem = (char *)mmap(nullptr, cxl_nhc_range, PROT_READ | PROT_WRITE, MAP_SHARED, fd, cxl_hc_range);
+    cxl_nhc_buf = (char *)mmap((void*)CXL_NHC_START, cxl_nhc_range, PROT_READ | PROT_WRITE,  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+    close(fd);
+    if ((uintptr_t)cxl_nhc_buf == -1 || (uintptr_t)nhc_mem == -1) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    nc_sim_init(cxl_nhc_buf, nhc_mem, cxl_nhc_range);
+#else
     cxl_nhc_buf = (char *)mmap((void*)CXL_NHC_START, cxl_nhc_range, PROT_READ | PROT_WRITE,  MAP_SHARED | MAP_FIXED_NOREPLACE, fd, cxl_hc_range);
     close(fd);
     if ((uintptr_t)cxl_nhc_buf == -1) {
         perror("mmap");
         exit(EXIT_FAILURE);
     }
+    char *nhc_mem = cxl_nhc_buf;
+#endif
 
 #if CXL_NUMA_MODE
     // bind cxl memory buffers to CXL NUMA node
     unsigned long nodemask = 0;
     nodemask |= 1 << CXL_NUMA_NODE_ID;
-    if(mbind(cxl_nhc_buf, cxl_nhc_range, MPOL_BIND, &nodemask, sizeof(nodemask) * 8, 0) < 0) {
+    if(mbind(nhc_mem, cxl_nhc_range, MPOL_BIND, &nodemask, sizeof(nodemask) * 8, 0) < 0) {
         perror("mbind");
         exit(EXIT_FAILURE);
     }
@@ -216,6 +241,21 @@ void rac_init(unsigned nid, size_t cxl_hc_rg, size_t cxl_nhc_rg, size_t root_siz
         perror("numa_run_on_node");
         exit(EXIT_FAILURE);
     }
+#if FLUSH_DISPATCH
+    init_flush_dispatch();
+#endif
+#if !NO_FLUSH
+    // wbinvd() exits without the kernel module, so the thresholds that
+    // trigger it must never be reached
+    if (access(WBINVD_PATH, R_OK))
+        disable_bulk_flush();
+#endif
+#if CALIBRATE_ON_INIT
+    calibrate_flush_costs();
+#endif
+#if CXL_EMULATION
+    cxl_emu_init(flush_costs.tsc_per_ns ? flush_costs.tsc_per_ns : CPU_FREQ_MHZ / 1000.0);
+#endif
     meta = (GlobalMeta*)cxl_hc_buf;
     size_t cxl_hc_off = sizeof(GlobalMeta) + root_size;
     assert(cxl_hc_range > cxl_hc_off && "hardware coherent memory region too small");
@@ -225,7 +265,8 @@ void rac_init(unsigned nid, size_t cxl_hc_rg, size_t cxl_nhc_rg, size_t root_siz
         cxl_alloc_process_init(&meta->alloc_meta, cxl_hc_buf + cxl_hc_off, cxl_hc_range - cxl_hc_off, cxl_nhc_buf, cxl_nhc_range, true);
         cxl_alloc_thread_init();
 
-        new (&meta->log_mgrs[node_id]) LogManager(node_id);
+        new (&meta->doorbells[node_id]) Doorbell();
+        new (&meta->log_mgrs[node_id]) LogManager(node_id, meta->doorbells);
         meta->curr_tid.store(0);
 
         thread_ops = new ThreadOps(&meta->log_mgrs[0], &cache_info, node_id, meta->curr_tid.fetch_add(1, std::memory_order_relaxed));
@@ -236,31 +277,46 @@ void rac_init(unsigned nid, size_t cxl_hc_rg, size_t cxl_nhc_rg, size_t root_siz
 
         cxl_alloc_process_init(&meta->alloc_meta, cxl_hc_buf + cxl_hc_off, cxl_hc_range - cxl_hc_off, cxl_nhc_buf, cxl_nhc_range, false);
         cxl_alloc_thread_init();
-        new (&meta->log_mgrs[node_id]) LogManager(node_id);
+        new (&meta->doorbells[node_id]) Doorbell();
+        new (&meta->log_mgrs[node_id]) LogManager(node_id, meta->doorbells);
         thread_ops = new ThreadOps(&meta->log_mgrs[0], &cache_info, node_id, meta->curr_tid.fetch_add(1, std::memory_order_relaxed));
     }
     instrument_lib();
 
 #if !PROTOCOL_OFF
-    unsigned cpu_id = node_id;
-    int ret;
+    for (unsigned i = 0; i < CACHE_AGENT_COUNT; i++) {
+        unsigned cpu_id = node_id * CACHE_AGENT_COUNT + i;
+        int ret;
 #ifdef CACHE_AGENT_AFFINITY
-    ret = find_cpu_on_numa(cpu_id, LOCAL_NUMA_NODE_ID);
-    assert(!ret);
+        ret = find_cpu_on_numa(cpu_id, LOCAL_NUMA_NODE_ID);
+        assert(!ret);
 #endif
-    auto arg = new CacheAgentArg{node_id, cpu_id};
-    ret = pthread_create(&cache_agent, nullptr, run_cache_agent, arg);
-    assert(!ret);
+        auto arg = new CacheAgentArg{node_id, i, cpu_id};
+        ret = pthread_create(&cache_agents[i], nullptr, run_cache_agent, arg);
+        assert(!ret);
+    }
 #endif
 }
 
 void rac_shutdown() {
 #if !PROTOCOL_OFF
     complete.store(true);
-    void *arg;
-    int ret = pthread_join(cache_agent, &arg);
-    assert(!ret);
-    delete (CacheAgentArg*)arg;
+    // agents may be waiting for logs
+    auto &doorbell = meta->doorbells[node_id];
+    doorbell.seq.fetch_add(1);
+    futex_wake(&doorbell.seq);
+    for (auto &agent: cache_agents) {
+        void *arg;
+        int ret = pthread_join(agent, &arg);
+        assert(!ret);
+        delete (CacheAgentArg*)arg;
+    }
+#endif
+#if CXL_EMULATION
+    cxl_emu_dump_stats();
+#endif
+#if NC_SIMULATION
+    nc_sim_dump_stats();
 #endif
     STATS(
         LOG_STATS("node " << i << " stats:");
@@ -0,0 +1,139 @@
+#include <atomic>
+#include <chrono>
+#include <sys/mman.h>
+#include <thread>
+#include <gtest/gtest.h>
+
+#include "cacheInfo.hpp"
+#include "cxlMalloc.hpp"
+#include "cxlSync.hpp"
+
+using namespace RACoherence;
+
+namespace {
+
+constexpr size_t TEST_HC_RANGE = 1ull << 26;
+constexpr size_t TEST_NHC_RANGE = 1ull << 26;
+
+// clocks stay zero without logs, so acquires never wait on cache agents
+CacheInfo test_cache_info;
+std::atomic<unsigned> test_tid{0};
+
+char *map_range(size_t size) {
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return p == MAP_FAILED ? nullptr : (char *)p;
+}
+
+// every thread using CXL sync objects needs an allocator heap and thread ops
+void init_test_thread() {
+    cxl_alloc_thread_init();
+    thread_ops = new ThreadOps(nullptr, &test_cache_info, 0, test_tid.fetch_add(1));
+}
+
+void sleep_ms(unsigned ms) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+class CXLSyncTest: public ::testing::Test {
+protected:
+    static void SetUpTestSuite() {
+        // constructed by cxl_alloc_process_init
+        alignas(AllocMeta) static char meta[sizeof(AllocMeta)];
+        char *hc = map_range(TEST_HC_RANGE);
+        char *nhc = map_range(TEST_NHC_RANGE);
+        ASSERT_TRUE(hc && nhc);
+        cxl_alloc_process_init((AllocMeta *)meta, hc, TEST_HC_RANGE, nhc, TEST_NHC_RANGE, true);
+    }
+
+    void SetUp() override {
+        init_test_thread();
+    }
+};
+
+} // namespace
+
+// A reader that enters through the writer lock while the bias is revoked
+// holds only its reader count, and the next writer must still wait for it.
+TEST_F(CXLSyncTest, SharedMutexSlowReaderExcludesWriter) {
+    CXLSharedMutex mtx;
+    std::atomic<int> readers{0};
+    std::atomic<bool> writer_in{false};
+    std::atomic<bool> overlap{false};
+
+    // a reader holding the bias makes the revocation, and so the time the
+    // bias stays inhibited, long enough for the slow-path reader below
+    std::atomic<bool> biased_in{false};
+    std::thread biased([&] {
+        init_test_thread();
+        mtx.lock_shared();
+        biased_in = true;
+        sleep_ms(50);
+        mtx.unlock_shared();
+    });
+    while (!biased_in)
+        sleep_ms(1);
+    mtx.lock();
+    mtx.unlock();
+    biased.join();
+
+    std::atomic<bool> slow_in{false};
+    std::thread slow([&] {
+        init_test_thread();
+        mtx.lock_shared();
+        readers++;
+        slow_in = true;
+        sleep_ms(50);
+        if (writer_in)
+            overlap = true;
+        readers--;
+        mtx.unlock_shared();
+    });
+    while (!slow_in)
+        sleep_ms(1);
+
+    mtx.lock();
+    writer_in = true;
+    if (readers)
+        overlap = true;
+    writer_in = false;
+    mtx.unlock();
+    slow.join();
+
+    EXPECT_FALSE(overlap);
+}
+
+// Unlock marks stale for other nodes exactly the lines reported with
+// mark_dirty, and all of the data if the holder reported nothing after
+// taking it with get().
+TEST_F(CXLSyncTest, RelaxedMutexMarksWrittenLinesStale) {
+    using RelaxedMutex = CXLRelaxedMutex<int, 1024>;
+    alignas(CACHE_LINE_SIZE) static int data[1024];
+    auto *inner = (RelaxedMutex::InnerData *)cxlhc_malloc(sizeof(RelaxedMutex::InnerData));
+    RelaxedMutex mtx(inner, data);
+    auto &other = inner->stale[1];
+    constexpr size_t LINES = sizeof(data) / CACHE_LINE_SIZE;
+    constexpr size_t INTS_PER_LINE = CACHE_LINE_SIZE / sizeof(int);
+
+    mtx.lock();
+    other.clear();
+    mtx.get()[2 * INTS_PER_LINE] = 1;
+    mtx.mark_dirty(mtx.get() + 2 * INTS_PER_LINE);
+    mtx.unlock();
+    ASSERT_EQ(other.count, 1u);
+    EXPECT_EQ(other.ranges[0].begin, 2u);
+    EXPECT_EQ(other.ranges[0].end, 3u);
+
+    mtx.lock();
+    other.clear();
+    mtx.get()[5] = 1;
+    mtx.unlock();
+    ASSERT_EQ(other.count, 1u);
+    EXPECT_EQ(other.ranges[0].begin, 0u);
+    EXPECT_EQ(other.ranges[0].end, LINES);
+
+    // without get() nothing can have been written
+    mtx.lock();
+    other.clear();
+    mtx.unlock();
+    EXPECT_EQ(other.count, 0u);
+}
@@ -41,3 +41,150 @@ TEST(CacheLineTrackerTest, DifferentPages) {
     EXPECT_FALSE(tracker.is_dirty(va1));
     EXPECT_TRUE(tracker.is_dirty(va2));
 }
+
+// range invalidation flushes the lines it finds dirty, so it needs real memory
+alignas(PAGE_SIZE) static char range_buf[1 << 20];
+
+TEST(CacheLineTrackerTest, RangeInvalidate) {
+    CacheLineTracker tracker;
+
+    uintptr_t va1 = (uintptr_t)range_buf;
+    uintptr_t va2 = va1 + 70 * VIRTUAL_CL_SIZE; // Different leaf
+
+    tracker.mark_dirty(va1);
+    tracker.mark_dirty(va2);
+
+    EXPECT_TRUE(tracker.invalidate_range_if_dirty(va1, va1 + sizeof(range_buf)));
+    EXPECT_FALSE(tracker.is_dirty(va1));
+    EXPECT_FALSE(tracker.is_dirty(va2));
+    EXPECT_FALSE(tracker.invalidate_range_if_dirty(va1, va1 + sizeof(range_buf)));
+}
+
+TEST(CacheLineTrackerTest, RangeBounds) {
+    CacheLineTracker tracker;
+
+    uintptr_t va = (uintptr_t)range_buf;
+    tracker.mark_dirty(va);
+    tracker.mark_dirty(va + 10 * VIRTUAL_CL_SIZE);
+    tracker.mark_dirty(va + 20 * VIRTUAL_CL_SIZE);
+
+    // partial lines at both ends are included, the line at end is not
+    EXPECT_TRUE(tracker.invalidate_range_if_dirty(va + 1, va + 10 * VIRTUAL_CL_SIZE));
+    EXPECT_FALSE(tracker.is_dirty(va));
+    EXPECT_TRUE(tracker.is_dirty(va + 10 * VIRTUAL_CL_SIZE));
+
+    EXPECT_TRUE(tracker.invalidate_range_if_dirty(va + 20 * VIRTUAL_CL_SIZE + 1, va + 20 * VIRTUAL_CL_SIZE + 2));
+    EXPECT_FALSE(tracker.is_dirty(va + 20 * VIRTUAL_CL_SIZE));
+    EXPECT_TRUE(tracker.is_dirty(va + 10 * VIRTUAL_CL_SIZE));
+}
+
+TEST(CacheLineTrackerTest, RangeSkipsClean) {
+    CacheLineTracker tracker;
+
+    // a clean 64 GB range is rejected by the summaries without visiting leaves
+    EXPECT_FALSE(tracker.invalidate_range_if_dirty(CXL_NHC_START, CXL_NHC_START + (1ull << 36)));
+
+    uintptr_t va = (uintptr_t)range_buf;
+    tracker.mark_dirty(va);
+    tracker.clear_dirty(va);
+    EXPECT_FALSE(tracker.invalidate_range_if_dirty(va, va + sizeof(range_buf)));
+}
+
+TEST(CacheLineTrackerTest, RecycleEmptyLeaves) {
+    CacheLineTracker tracker;
+
+    uintptr_t va1 = 0x00007fff12345000;
+    uintptr_t va2 = 0x00007fff22345000;
+
+    tracker.mark_dirty(va1);
+    tracker.mark_dirty(va1 + 64);
+    tracker.clear_dirty(va1);
+    EXPECT_TRUE(tracker.is_dirty(va1 + 64));
+
+    // leaf of va1 becomes empty and is retired
+    tracker.clear_dirty(va1 + 64);
+    tracker.reclaim();
+    EXPECT_FALSE(tracker.is_dirty(va1 + 64));
+
+    // recycled leaf starts clean
+    tracker.mark_dirty(va2);
+    EXPECT_TRUE(tracker.is_dirty(va2));
+    EXPECT_FALSE(tracker.is_dirty(va2 + 64));
+    EXPECT_FALSE(tracker.is_dirty(va1));
+
+    tracker.mark_dirty(va1 + 128);
+    EXPECT_TRUE(tracker.is_dirty(va1 + 128));
+    EXPECT_TRUE(tracker.is_dirty(va2));
+}
+
+TEST(CacheLineTrackerTest, ClearAll) {
+    CacheLineTracker tracker;
+
+    uintptr_t va1 = 0x00007fff12345000;
+    uintptr_t va2 = 0x00007fff22345000;
+
+    tracker.mark_dirty(va1);
+    tracker.mark_dirty(va2, ~0ull);
+    EXPECT_EQ(tracker.leaf_count(), 2u);
+
+    tracker.clear_all();
+    EXPECT_EQ(tracker.leaf_count(), 0u);
+    EXPECT_FALSE(tracker.is_dirty(va1));
+    EXPECT_FALSE(tracker.invalidate_if_dirty(va2));
+    EXPECT_FALSE(tracker.invalidate_range_if_dirty(va1, va2 + 4096));
+
+    // stale table of va1 is replaced with a clean one
+    tracker.mark_dirty(va1 + 64);
+    EXPECT_TRUE(tracker.is_dirty(va1 + 64));
+    EXPECT_FALSE(tracker.is_dirty(va1));
+    EXPECT_EQ(tracker.leaf_count(), 1u);
+
+    // stale table of va2 is swept out
+    for (uint64_t i = 0; i < L1_ENTRIES / TRACKER_SWEEP_BATCH; i++)
+        tracker.reclaim();
+    EXPECT_FALSE(tracker.is_dirty(va2));
+    EXPECT_TRUE(tracker.is_dirty(va1 + 64));
+    tracker.mark_dirty(va2 + 64);
+    EXPECT_TRUE(tracker.is_dirty(va2 + 64));
+    EXPECT_FALSE(tracker.is_dirty(va2));
+}
+
+TEST(CacheLineTrackerTest, RangeMark) {
+    CacheLineTracker tracker;
+
+    uintptr_t va = reinterpret_cast<uintptr_t>(range_buf);
+    uintptr_t begin = va + 3 * VIRTUAL_CL_SIZE;
+    uintptr_t end = va + 5 * (1ull << LEAF_SHIFT) + 7 * VIRTUAL_CL_SIZE;
+
+    tracker.mark_range_dirty(begin, end);
+    EXPECT_FALSE(tracker.is_dirty(begin - VIRTUAL_CL_SIZE));
+    EXPECT_FALSE(tracker.is_dirty(end));
+    for (uintptr_t cl = begin; cl < end; cl += VIRTUAL_CL_SIZE)
+        ASSERT_TRUE(tracker.is_dirty(cl));
+
+    EXPECT_TRUE(tracker.invalidate_range_if_dirty(va, va + sizeof(range_buf)));
+    EXPECT_FALSE(tracker.is_dirty(begin));
+    EXPECT_FALSE(tracker.is_dirty(end - VIRTUAL_CL_SIZE));
+}
+
+TEST(CacheLineTrackerTest, DrainRange) {
+    CacheLineTracker tracker;
+
+    uintptr_t va = reinterpret_cast<uintptr_t>(range_buf);
+    uintptr_t end = va + sizeof(range_buf);
+    tracker.mark_dirty(va, 0xf);
+    tracker.mark_dirty(va + 8 * (1ull << LEAF_SHIFT), 0xf0);
+
+    // budget runs out after the first leaf, stops at the next dirty one
+    size_t budget = 4;
+    uintptr_t stop = tracker.drain_range(va, end, budget);
+    EXPECT_EQ(budget, 0u);
+    EXPECT_EQ(stop, va + 8 * (1ull << LEAF_SHIFT));
+    EXPECT_FALSE(tracker.is_dirty(va));
+    EXPECT_TRUE(tracker.is_dirty(va + 8 * (1ull << LEAF_SHIFT) + 4 * VIRTUAL_CL_SIZE));
+
+    budget = 100;
+    EXPECT_EQ(tracker.drain_range(stop, end, budget), end);
+    EXPECT_EQ(budget, 96u);
+    EXPECT_FALSE(tracker.invalidate_range_if_dirty(va, end));
+}
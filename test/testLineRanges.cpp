@@ -0,0 +1,113 @@
+#include <utility>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "lineRanges.hpp"
+
+using namespace RACoherence;
+
+namespace {
+
+template<unsigned Cap>
+std::vector<std::pair<size_t, size_t>> ranges_of(const LineRanges<Cap> &r) {
+    std::vector<std::pair<size_t, size_t>> out;
+    for (unsigned i = 0; i < r.count; i++)
+        out.emplace_back(r.ranges[i].begin, r.ranges[i].end);
+    return out;
+}
+
+using Ranges = std::vector<std::pair<size_t, size_t>>;
+
+} // namespace
+
+TEST(LineRangesTest, KeepsDisjointRangesSorted) {
+    LineRanges<4> r;
+    r.add(20, 30);
+    r.add(0, 5);
+    r.add(10, 12);
+    EXPECT_EQ(ranges_of(r), (Ranges{{0, 5}, {10, 12}, {20, 30}}));
+}
+
+TEST(LineRangesTest, MergesOverlap) {
+    LineRanges<4> r;
+    r.add(10, 20);
+    r.add(15, 25);
+    r.add(5, 12);
+    EXPECT_EQ(ranges_of(r), (Ranges{{5, 25}}));
+
+    // a range inside an existing one changes nothing
+    r.add(8, 9);
+    EXPECT_EQ(ranges_of(r), (Ranges{{5, 25}}));
+}
+
+TEST(LineRangesTest, MergesAdjacent) {
+    LineRanges<4> r;
+    r.add(0, 4);
+    r.add(8, 12);
+    r.add(4, 8);
+    EXPECT_EQ(ranges_of(r), (Ranges{{0, 12}}));
+
+    r.add(12, 13);
+    EXPECT_EQ(ranges_of(r), (Ranges{{0, 13}}));
+}
+
+TEST(LineRangesTest, MergesSeveralRangesAtOnce) {
+    LineRanges<4> r;
+    r.add(0, 2);
+    r.add(4, 6);
+    r.add(8, 10);
+    r.add(20, 22);
+    r.add(1, 9);
+    EXPECT_EQ(ranges_of(r), (Ranges{{0, 10}, {20, 22}}));
+}
+
+TEST(LineRangesTest, FillsToCapacityExactly) {
+    LineRanges<3> r;
+    r.add(0, 1);
+    r.add(10, 11);
+    r.add(20, 21);
+    EXPECT_EQ(ranges_of(r), (Ranges{{0, 1}, {10, 11}, {20, 21}}));
+}
+
+TEST(LineRangesTest, OverflowCoalescesClosestPair) {
+    LineRanges<3> r;
+    r.add(0, 1);
+    r.add(50, 51);
+    r.add(100, 101);
+    // lands in the spare slot, then the closest gap, 5 lines, is closed
+    r.add(56, 57);
+    EXPECT_EQ(ranges_of(r), (Ranges{{0, 1}, {50, 57}, {100, 101}}));
+
+    // the first pair can be the closest one
+    r.add(3, 4);
+    EXPECT_EQ(ranges_of(r), (Ranges{{0, 4}, {50, 57}, {100, 101}}));
+
+    // and so can the last
+    r.add(103, 104);
+    EXPECT_EQ(ranges_of(r), (Ranges{{0, 4}, {50, 57}, {100, 104}}));
+}
+
+TEST(LineRangesTest, OverflowNeverDropsLines) {
+    LineRanges<2> r;
+    std::vector<size_t> lines = {40, 3, 77, 18, 91, 60, 5, 33};
+    for (auto l: lines)
+        r.add(l, l + 1);
+    ASSERT_LE(r.count, 2u);
+    for (auto l: lines) {
+        bool covered = false;
+        for (unsigned i = 0; i < r.count; i++)
+            covered |= r.ranges[i].begin <= l && l < r.ranges[i].end;
+        EXPECT_TRUE(covered) << "line " << l;
+    }
+    for (unsigned i = 1; i < r.count; i++)
+        EXPECT_LT(r.ranges[i - 1].end, r.ranges[i].begin);
+}
+
+TEST(LineRangesTest, Clear) {
+    LineRanges<2> r;
+    r.add(0, 4);
+    r.clear();
+    EXPECT_EQ(r.count, 0u);
+    r.add(8, 9);
+    EXPECT_EQ(ranges_of(r), (Ranges{{8, 9}}));
+}
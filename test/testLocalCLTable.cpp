@@ -0,0 +1,123 @@
+#include <set>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "localCLTable.hpp"
+
+using namespace RACoherence;
+
+namespace {
+
+// virtual cache line number of the first line of a group
+constexpr uintptr_t GROUP_CL = 0x12345ull << cl_group::GROUP_SIZE_SHIFT;
+
+DataRange line_range(uintptr_t first_cl, uintptr_t end_cl) {
+    return DataRange((void *)(first_cl << VIRTUAL_CL_SHIFT), (end_cl - first_cl) << VIRTUAL_CL_SHIFT);
+}
+
+// virtual cache lines covered by entries
+std::set<uintptr_t> lines_of(const std::vector<cl_group_t> &entries) {
+    std::set<uintptr_t> lines;
+    for (auto entry: entries) {
+        process_cl_group(entry, [&](uintptr_t ptr, uint64_t mask) {
+            for (unsigned i = 0; i < cl_group::GROUP_SIZE; i++)
+                if (mask & (1ull << i))
+                    lines.insert((ptr >> VIRTUAL_CL_SHIFT) + i);
+        });
+    }
+    return lines;
+}
+
+// entries the next write_to_log would publish
+std::vector<cl_group_t> pending(LocalCLTable &table) {
+    std::vector<cl_group_t> entries;
+    for (auto entry: table)
+        if (entry)
+            entries.push_back(entry);
+    return entries;
+}
+
+std::vector<cl_group_t> take(LocalCLTable &table, const DataRange *ranges, size_t count) {
+    std::vector<cl_group_t> taken;
+    table.take_overlapping(ranges, count, [&](cl_group_t entry) {
+        taken.push_back(entry);
+    });
+    return taken;
+}
+
+} // namespace
+
+TEST(LocalCLTableTest, TakePartialMask) {
+    LocalCLTable table;
+    for (uintptr_t cl = GROUP_CL + 2; cl < GROUP_CL + 6; cl++)
+        ASSERT_FALSE(table.insert(cl));
+
+    DataRange range = line_range(GROUP_CL + 4, GROUP_CL + 8);
+    auto taken = take(table, &range, 1);
+    ASSERT_EQ(taken.size(), 1u);
+    EXPECT_FALSE(cl_group::is_length_based(taken[0]));
+    EXPECT_EQ(lines_of(taken), (std::set<uintptr_t>{GROUP_CL + 4, GROUP_CL + 5}));
+    EXPECT_EQ(lines_of(pending(table)), (std::set<uintptr_t>{GROUP_CL + 2, GROUP_CL + 3}));
+}
+
+TEST(LocalCLTableTest, TakeRangeSpanningGroups) {
+    LocalCLTable table;
+    uintptr_t next = GROUP_CL + cl_group::GROUP_SIZE;
+    for (uintptr_t cl: {GROUP_CL + 5, next - 2, next - 1, next, next + 1})
+        ASSERT_FALSE(table.insert(cl));
+
+    // from the last line of the first group to the first line of the next
+    DataRange range = line_range(next - 1, next + 1);
+    auto taken = take(table, &range, 1);
+    ASSERT_EQ(taken.size(), 2u);
+    EXPECT_EQ(lines_of(taken), (std::set<uintptr_t>{next - 1, next}));
+    EXPECT_EQ(lines_of(pending(table)), (std::set<uintptr_t>{GROUP_CL + 5, next - 2, next + 1}));
+}
+
+TEST(LocalCLTableTest, TakeLengthEntryWhole) {
+    LocalCLTable table;
+    uintptr_t begin = GROUP_CL;
+    uintptr_t end = GROUP_CL + 5 * cl_group::GROUP_SIZE;
+    ASSERT_FALSE(table.range_insert(begin, end));
+    ASSERT_EQ(table.get_length_entry_count(), 1);
+
+    // a single line in the middle takes all five groups
+    DataRange range = line_range(GROUP_CL + 40, GROUP_CL + 41);
+    auto taken = take(table, &range, 1);
+    ASSERT_EQ(taken.size(), 1u);
+    EXPECT_TRUE(cl_group::is_length_based(taken[0]));
+    EXPECT_EQ(cl_group::get_length(taken[0]), 5u);
+    EXPECT_EQ(table.get_length_entry_count(), 0);
+    EXPECT_TRUE(pending(table).empty());
+}
+
+TEST(LocalCLTableTest, TakeLeavesRemainderForLog) {
+    LocalCLTable table;
+    std::set<uintptr_t> inserted;
+    for (uintptr_t g = 0; g < 4; g++) {
+        for (uintptr_t i = 0; i < cl_group::GROUP_SIZE; i += 3) {
+            uintptr_t cl = GROUP_CL + g * cl_group::GROUP_SIZE + i;
+            ASSERT_FALSE(table.insert(cl));
+            inserted.insert(cl);
+        }
+    }
+
+    DataRange ranges[2] = {
+        line_range(GROUP_CL + 1, GROUP_CL + 10),
+        line_range(GROUP_CL + 30, GROUP_CL + 50),
+    };
+    auto taken = take(table, ranges, 2);
+    auto rest = pending(table);
+
+    std::set<uintptr_t> expect_taken, expect_rest;
+    for (auto cl: inserted) {
+        bool in_range = (cl >= GROUP_CL + 1 && cl < GROUP_CL + 10) || (cl >= GROUP_CL + 30 && cl < GROUP_CL + 50);
+        (in_range ? expect_taken : expect_rest).insert(cl);
+    }
+    EXPECT_EQ(lines_of(taken), expect_taken);
+    EXPECT_EQ(lines_of(rest), expect_rest);
+
+    // taking the same ranges again finds nothing
+    EXPECT_TRUE(take(table, ranges, 2).empty());
+    EXPECT_EQ(lines_of(pending(table)), expect_rest);
+}
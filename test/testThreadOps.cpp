@@ -0,0 +1,95 @@
+#include <memory>
+#include <set>
+#include <gtest/gtest.h>
+
+#include "threadOps.hpp"
+
+using namespace RACoherence;
+
+namespace {
+
+CacheInfo test_cache_info;
+Doorbell test_doorbells[NODE_COUNT];
+
+// node 0 releases, node 1 reads what it would consume
+constexpr unsigned READER = 1;
+
+alignas(1ull << cl_group::GROUP_SHIFT) char buf[4 << cl_group::GROUP_SHIFT];
+
+uintptr_t line_of(const char *p) {
+    return (uintptr_t)p >> VIRTUAL_CL_SHIFT;
+}
+
+class ThreadOpsTest: public ::testing::Test {
+protected:
+    std::unique_ptr<LogManager> mgr{new LogManager(0, test_doorbells)};
+    ThreadOps ops{mgr.get(), &test_cache_info, 0, 0};
+
+    // lines of the next log node READER would consume, consumes it
+    bool consume(std::set<uintptr_t> &lines, bool &is_rel) {
+        auto *entry = mgr->take_head(READER);
+        if (!entry)
+            return false;
+        is_rel = entry->is_rel;
+        for (auto cg: *entry->log.load()) {
+            process_cl_group(cg, [&](uintptr_t ptr, uint64_t mask) {
+                for (unsigned i = 0; i < cl_group::GROUP_SIZE; i++)
+                    if (mask & (1ull << i))
+                        lines.insert((ptr >> VIRTUAL_CL_SHIFT) + i);
+            });
+        }
+        mgr->consume_head(READER);
+        return true;
+    }
+
+    std::set<uintptr_t> consume_release() {
+        std::set<uintptr_t> lines;
+        bool is_rel = false;
+        EXPECT_TRUE(consume(lines, is_rel));
+        EXPECT_TRUE(is_rel);
+        return lines;
+    }
+};
+
+} // namespace
+
+// The line last stored stays cached for INLINE_CACHING, so a scoped release
+// that takes its entry must not let the next store to it be skipped.
+TEST_F(ThreadOpsTest, ScopedReleaseRepublishesRewrittenLine) {
+    DataRange range(buf, CACHE_LINE_SIZE);
+    for (int round = 0; round < 3; round++) {
+        ops.log_store(buf);
+        ASSERT_TRUE(ops.thread_release_scoped(&range, 1));
+        EXPECT_EQ(consume_release(), std::set<uintptr_t>{line_of(buf)});
+    }
+}
+
+TEST_F(ThreadOpsTest, ScopedReleaseWithoutOverlapProducesNoLog) {
+    ops.log_store(buf);
+    DataRange range(buf + 2 * VIRTUAL_CL_SIZE, VIRTUAL_CL_SIZE);
+    EXPECT_FALSE(ops.thread_release_scoped(&range, 1));
+    std::set<uintptr_t> lines;
+    bool is_rel;
+    EXPECT_FALSE(consume(lines, is_rel));
+
+    // the line is still pending for the next full release
+    ASSERT_TRUE(ops.thread_release());
+    EXPECT_EQ(consume_release(), std::set<uintptr_t>{line_of(buf)});
+}
+
+TEST_F(ThreadOpsTest, ScopedReleaseLeavesRemainderPending) {
+    char *in = buf;
+    char *out = buf + (1ull << cl_group::GROUP_SHIFT) + VIRTUAL_CL_SIZE;
+    ops.log_store(out);
+    ops.log_store(in);
+    DataRange range(in, VIRTUAL_CL_SIZE);
+    ASSERT_TRUE(ops.thread_release_scoped(&range, 1));
+    EXPECT_EQ(consume_release(), std::set<uintptr_t>{line_of(in)});
+
+    ASSERT_TRUE(ops.thread_release());
+    EXPECT_EQ(consume_release(), std::set<uintptr_t>{line_of(out)});
+
+    // nothing left to publish
+    EXPECT_FALSE(ops.thread_release());
+    EXPECT_FALSE(ops.thread_release_scoped(&range, 1));
+}